@@ -0,0 +1,949 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+//
+// Command line tool around libkrenq.
+//
+// Every command works on the paths given, with as many workers as
+// asked for. Progress goes to stderr, the summary to stdout, either
+// as plain lines or as a single JSON object.
+//
+
+// Exit status of a run that found corrupted files.
+static const int g_exitCorrupted{2};
+// Exit status of a bench whose workers allocated memory once warm.
+static const int g_exitAllocations{3};
+// Time between two progress lines.
+static const std::chrono::milliseconds g_progressInterval{250};
+// Sparse bench files hold this many data extents of this size, the
+// rest of them being holes.
+static const std::uint64_t g_sparseExtents{64};
+static const size_t g_sparseExtent{1024 * 1024};
+// Times every file is replaced while watch bench encrypts it.
+static const size_t g_watchRounds{4};
+static const std::chrono::milliseconds g_watchPause{5};
+
+// Heap allocations made so far by threads of the library. Threads of
+// the tool itself, main and progress, mark themselves and aren't
+// counted. Bench reports them per file.
+static std::atomic<std::uint64_t> g_allocations{0};
+static thread_local bool g_toolThread{false};
+
+void* operator new(size_t n)
+{
+  if (!g_toolThread) g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p{std::malloc(n > 0 ? n : 1)}) return p;
+  throw std::bad_alloc{};
+}
+
+void* operator new[](size_t n)
+{
+  return ::operator new(n);
+}
+
+// Freed as they were allocated, with malloc(), which GCC can't tell
+// once these are inlined.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+  std::free(p);
+}
+#pragma GCC diagnostic pop
+
+static const char* g_usage{
+R"(usage: krenq <command> [options] <path>...
+
+commands:
+  encrypt     encrypt with a fresh key, saved as --key
+  decrypt     decrypt with --key (repeat it, or give directories of keys)
+  re-encrypt  move files from --key to --new-key, saved fresh if not there
+  status      tell plain files from encrypted ones, no key needed
+  verify      check files encrypted with --key against their hash
+  sweep       delete chunks of --dedup store no file under <path> uses,
+              reading files with --key (repeat it, or give directories)
+  bench       time buffered and direct I/O on files made under <path>,
+              or large sparse files with --sparse, checked after, and
+              check that warm workers allocate no memory; with --watch,
+              replace files while watch mode encrypts them
+  keygen      make a fresh key in every <path>
+
+options:
+  -k, --key FILE          key file
+      --new-key FILE      key file to move files to
+  -j, --jobs N            workers per non-rotational device (default: CPUs)
+      --hdd-jobs N        workers per rotational device (default: 1)
+      --memory BYTES      run no more workers than fit in BYTES
+      --read-rate BYTES   read at most BYTES per second
+      --write-rate BYTES  write at most BYTES per second
+      --iops N            at most N I/O operations per second
+      --ionice CLASS[:N]  idle, best-effort or realtime, with level N
+      --nice N            nice value of workers
+      --direct            bypass page cache
+      --durability MODE   none, file or batch
+      --chunk-size BYTES  write chunked format with chunks of BYTES
+      --compress          compress before encrypting
+      --dedup DIR         deduplicate through chunk store DIR
+      --huge-pages        back worker buffers with huge pages
+      --files N           bench: number of files (default: 8)
+      --size BYTES        bench: size of every file (default: 64M)
+      --sparse            bench: make sparse files, which may be terabytes
+      --watch             bench: replace files while watch mode encrypts them
+  -l, --list              status: list every file
+      --json              print summary as JSON
+      --progress          always show progress
+  -q, --quiet             never show progress
+  -h, --help              show this help
+
+BYTES take K, M, G and T suffixes, powers of 1024.
+)"};
+
+// Options given on the command line.
+struct Options
+{
+  std::string s_command{};
+  std::vector<std::string> s_paths{};
+  std::vector<std::string> s_keys{};
+  std::string s_newKey{};
+  size_t s_jobs{};
+  size_t s_hddJobs{1};
+  std::uint64_t s_memory{};
+  std::uint64_t s_readRate{};
+  std::uint64_t s_writeRate{};
+  std::uint64_t s_iops{};
+  Krenq::IoClass s_ioclass{Krenq::IoClass::none};
+  int s_iolevel{4};
+  int s_niceness{};
+  bool s_direct{};
+  Krenq::Durability s_durability{Krenq::Durability::none};
+  size_t s_chunkSize{};
+  bool s_compress{};
+  std::string s_dedup{};
+  bool s_hugePages{};
+  size_t s_benchFiles{8};
+  std::uint64_t s_benchSize{64 * 1024 * 1024};
+  bool s_sparse{};
+  bool s_watch{};
+  bool s_list{};
+  bool s_json{};
+  // Shown if stderr is a terminal, unless asked otherwise.
+  bool s_progress{};
+};
+
+//
+// Summary of a run, kept in order. Every field has a JSON value and
+// a value for people to read.
+//
+class Summary
+{
+public:
+  void add(const std::string& key, std::uint64_t value)
+  {
+    m_fields.push_back({key, std::to_string(value), std::to_string(value)});
+  }
+  void add(const std::string& key, const std::string& value)
+  {
+    m_fields.push_back({key, quote(value), value});
+  }
+  void add(const std::string& key, const std::vector<std::string>& values)
+  {
+    std::string json{"["};
+    std::string text{};
+    for (auto& value : values)
+    {
+      if (json.size() > 1) json += ',';
+      json += quote(value);
+      text += "\n  " + value;
+    }
+    m_fields.push_back({key, json + "]", text});
+  }
+  void add_raw(const std::string& key, const std::string& json, const std::string& text)
+  {
+    m_fields.push_back({key, json, text});
+  }
+  void print(bool json) const
+  {
+    if (json)
+    {
+      std::string out{"{"};
+      for (auto& field : m_fields)
+      {
+        if (out.size() > 1) out += ',';
+        out += quote(field.s_key);
+        out += ':';
+        out += field.s_json;
+      }
+      std::printf("%s}\n", out.c_str());
+      return;
+    }
+    for (auto& field : m_fields) std::printf("%s: %s\n", field.s_key.c_str(), field.s_text.c_str());
+  }
+  // Quote and escape a string for JSON.
+  static std::string quote(const std::string& s)
+  {
+    static const char digits[]{"0123456789abcdef"};
+    std::string out{"\""};
+    for (unsigned char c : s)
+    {
+      if (c == '"' or c == '\\') out += {'\\', static_cast<char>(c)};
+      else if (c < 0x20) out += {'\\', 'u', '0', '0', digits[c >> 4], digits[c & 0x0f]};
+      else out += static_cast<char>(c);
+    }
+    return out + "\"";
+  }
+
+private:
+  struct Field
+  {
+    std::string s_key{};
+    std::string s_json{};
+    std::string s_text{};
+  };
+  std::vector<Field> m_fields{};
+};
+
+// Parse a count.
+static std::uint64_t parse_number(const std::string& flag, const std::string& value)
+{
+  size_t used{};
+  std::uint64_t n{};
+  try
+  {
+    n = std::stoull(value, &used);
+  }
+  catch (const std::exception&)
+  {
+    used = 0;
+  }
+  if (used == 0 or used != value.size() or value[0] == '-')
+    throw std::runtime_error{"Invalid number for " + flag + ": " + value + "!"};
+  return n;
+}
+
+// Parse a size in bytes, with an optional binary suffix.
+static std::uint64_t parse_size(const std::string& flag, const std::string& value)
+{
+  static const std::string suffixes{"KMGT"};
+  size_t shift{};
+  std::string digits{value};
+  if (!digits.empty())
+  {
+    size_t pos{suffixes.find(static_cast<char>(std::toupper(static_cast<unsigned char>(digits.back()))))};
+    if (pos != std::string::npos)
+    {
+      shift = 10 * (pos + 1);
+      digits.pop_back();
+    }
+  }
+  std::uint64_t n{parse_number(flag, digits)};
+  if (shift > 0 and n > (UINT64_MAX >> shift))
+    throw std::runtime_error{"Size too large for " + flag + ": " + value + "!"};
+  return n << shift;
+}
+
+// Format bytes for people to read.
+static std::string human_bytes(double bytes)
+{
+  static const char* units[]{"B", "KiB", "MiB", "GiB", "TiB"};
+  size_t unit{};
+  while (bytes >= 1024 and unit + 1 < std::size(units))
+  {
+    bytes /= 1024;
+    ++unit;
+  }
+  char buf[32]{};
+  std::snprintf(buf, sizeof(buf), unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+  return buf;
+}
+
+// Parse command line into options. Flags may come anywhere after the command.
+static Options parse_options(int argc, char** argv)
+{
+  Options opts{};
+  opts.s_progress = isatty(STDERR_FILENO);
+  std::vector<std::string> args(argv + 1, argv + argc);
+  if (args.empty()) throw std::runtime_error{"No command given!"};
+  opts.s_command = args[0];
+  bool flagsDone{false};
+  for (size_t i{1}; i < args.size(); ++i)
+  {
+    std::string arg{args[i]};
+    if (flagsDone or arg.size() < 2 or arg[0] != '-')
+    {
+      opts.s_paths.emplace_back(arg);
+      continue;
+    }
+    if (arg == "--")
+    {
+      flagsDone = true;
+      continue;
+    }
+    // Values go after the flag, after '=' or, for short flags, right after them.
+    std::string flag{arg};
+    std::string value{};
+    bool hasValue{false};
+    if (size_t eq{arg.find('=')}; arg.starts_with("--") and eq != std::string::npos)
+    {
+      flag = arg.substr(0, eq);
+      value = arg.substr(eq + 1);
+      hasValue = true;
+    }
+    else if (!arg.starts_with("--") and arg.size() > 2)
+    {
+      flag = arg.substr(0, 2);
+      value = arg.substr(2);
+      hasValue = true;
+    }
+    auto next{[&]
+    {
+      if (hasValue) return value;
+      if (i + 1 >= args.size()) throw std::runtime_error{"Missing value for " + flag + "!"};
+      return args[++i];
+    }};
+    if (flag == "-k" or flag == "--key") opts.s_keys.emplace_back(next());
+    else if (flag == "--new-key") opts.s_newKey = next();
+    else if (flag == "-j" or flag == "--jobs") opts.s_jobs = parse_number(flag, next());
+    else if (flag == "--hdd-jobs") opts.s_hddJobs = parse_number(flag, next());
+    else if (flag == "--memory") opts.s_memory = parse_size(flag, next());
+    else if (flag == "--read-rate") opts.s_readRate = parse_size(flag, next());
+    else if (flag == "--write-rate") opts.s_writeRate = parse_size(flag, next());
+    else if (flag == "--iops") opts.s_iops = parse_number(flag, next());
+    else if (flag == "--ionice")
+    {
+      std::string spec{next()};
+      size_t colon{spec.find(':')};
+      std::string name{spec.substr(0, colon)};
+      if (name == "idle") opts.s_ioclass = Krenq::IoClass::idle;
+      else if (name == "best-effort") opts.s_ioclass = Krenq::IoClass::best_effort;
+      else if (name == "realtime") opts.s_ioclass = Krenq::IoClass::realtime;
+      else throw std::runtime_error{"Unknown I/O class: " + name + "!"};
+      if (colon != std::string::npos) opts.s_iolevel = static_cast<int>(parse_number(flag, spec.substr(colon + 1)));
+    }
+    else if (flag == "--nice")
+    {
+      std::string n{next()};
+      bool negative{n.starts_with("-")};
+      opts.s_niceness = static_cast<int>(parse_number(flag, negative ? n.substr(1) : n)) * (negative ? -1 : 1);
+    }
+    else if (flag == "--direct") opts.s_direct = true;
+    else if (flag == "--durability")
+    {
+      std::string mode{next()};
+      if (mode == "none") opts.s_durability = Krenq::Durability::none;
+      else if (mode == "file") opts.s_durability = Krenq::Durability::per_file;
+      else if (mode == "batch") opts.s_durability = Krenq::Durability::batched;
+      else throw std::runtime_error{"Unknown durability mode: " + mode + "!"};
+    }
+    else if (flag == "--chunk-size") opts.s_chunkSize = parse_size(flag, next());
+    else if (flag == "--compress") opts.s_compress = true;
+    else if (flag == "--dedup") opts.s_dedup = next();
+    else if (flag == "--huge-pages") opts.s_hugePages = true;
+    else if (flag == "--files") opts.s_benchFiles = parse_number(flag, next());
+    else if (flag == "--size") opts.s_benchSize = parse_size(flag, next());
+    else if (flag == "--sparse") opts.s_sparse = true;
+    else if (flag == "--watch") opts.s_watch = true;
+    else if (flag == "-l" or flag == "--list") opts.s_list = true;
+    else if (flag == "--json") opts.s_json = true;
+    else if (flag == "--progress") opts.s_progress = true;
+    else if (flag == "-q" or flag == "--quiet") opts.s_progress = false;
+    else throw std::runtime_error{"Unknown option: " + arg + "!"};
+  }
+  return opts;
+}
+
+// Apply options shared by all commands to a Krenq instance.
+static void configure(Krenq& k, const Options& opts)
+{
+  if (opts.s_jobs > 0 or opts.s_hddJobs != 1)
+    k.set_device_concurrency(opts.s_hddJobs, opts.s_jobs > 0 ? opts.s_jobs : std::max(1u, std::thread::hardware_concurrency()));
+  k.set_memory_limit(opts.s_memory);
+  k.set_io_limits(opts.s_readRate, opts.s_writeRate, opts.s_iops);
+  k.set_io_priority(opts.s_ioclass, opts.s_iolevel, opts.s_niceness);
+  k.set_direct_io(opts.s_direct);
+  k.set_durability(opts.s_durability);
+  k.set_chunk_size(opts.s_chunkSize);
+  k.set_compression(opts.s_compress);
+  k.set_dedup(opts.s_dedup);
+  k.set_huge_pages(opts.s_hugePages);
+}
+
+//
+// Run an operation on k, showing its progress on stderr meanwhile,
+// and add files, bytes and time taken to summary under given prefix.
+// Return seconds taken.
+//
+static double run_timed(Krenq& k, const Options& opts, const std::string& label, Summary& summary, const std::string& prefix, const std::function<void()>& op)
+{
+  std::atomic<bool> done{false};
+  auto start{std::chrono::steady_clock::now()};
+  auto seconds{[&]{ return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }};
+  std::thread progress{};
+  if (opts.s_progress)
+    progress = std::thread{[&]
+    {
+      g_toolThread = true;
+      while (!done)
+      {
+        std::this_thread::sleep_for(g_progressInterval);
+        Krenq::Progress p{k.get_progress()};
+        double elapsed{seconds()};
+        std::fprintf(stderr, "\r%s: %zu/%zu files, %s/%s, %s/s   ", label.c_str(), p.s_files, p.s_totalFiles,
+          human_bytes(static_cast<double>(p.s_bytes)).c_str(), human_bytes(static_cast<double>(p.s_totalBytes)).c_str(),
+          human_bytes(elapsed > 0 ? static_cast<double>(p.s_bytes) / elapsed : 0).c_str());
+      }
+      std::fprintf(stderr, "\n");
+    }};
+  try
+  {
+    op();
+  }
+  catch (...)
+  {
+    done = true;
+    if (progress.joinable()) progress.join();
+    throw;
+  }
+  double elapsed{seconds()};
+  done = true;
+  if (progress.joinable()) progress.join();
+  Krenq::Progress p{k.get_progress()};
+  double rate{elapsed > 0 ? static_cast<double>(p.s_bytes) / elapsed : 0};
+  char secs[32]{};
+  std::snprintf(secs, sizeof(secs), "%.3f", elapsed);
+  summary.add(prefix + "files", static_cast<std::uint64_t>(p.s_files));
+  summary.add_raw(prefix + "bytes", std::to_string(p.s_bytes), human_bytes(static_cast<double>(p.s_bytes)));
+  summary.add_raw(prefix + "seconds", secs, secs);
+  summary.add_raw(prefix + "bytes_per_second", std::to_string(static_cast<std::uint64_t>(rate)), human_bytes(rate) + "/s");
+  return elapsed;
+}
+
+// Make an instance holding given paths.
+static std::unique_ptr<Krenq> make_krenq(const Options& opts)
+{
+  if (opts.s_paths.empty()) throw std::runtime_error{"No paths given!"};
+  auto k{std::make_unique<Krenq>(std::initializer_list<std::string>{})};
+  for (auto& path : opts.s_paths) k->add_entries(path);
+  configure(*k, opts);
+  return k;
+}
+
+// Return the single key given.
+static const std::string& single_key(const Options& opts)
+{
+  if (opts.s_keys.size() != 1) throw std::runtime_error{opts.s_command + " needs exactly one --key!"};
+  return opts.s_keys.front();
+}
+
+static int cmd_encrypt(const Options& opts, Summary& summary)
+{
+  auto k{make_krenq(opts)};
+  std::string key{single_key(opts)};
+  k->save_key(key);
+  summary.add("key", Krenq::key_filename(key));
+  run_timed(*k, opts, "encrypt", summary, "", [&]{ k->encrypt_all(); });
+  return 0;
+}
+
+static int cmd_decrypt(const Options& opts, Summary& summary)
+{
+  if (opts.s_keys.empty()) throw std::runtime_error{"decrypt needs at least one --key!"};
+  auto k{make_krenq(opts)};
+  if (opts.s_keys.size() == 1 and fs::is_regular_file(opts.s_keys.front()))
+    run_timed(*k, opts, "decrypt", summary, "", [&]{ k->decrypt_all(opts.s_keys.front()); });
+  else
+  {
+    k->load_key_ring(opts.s_keys);
+    run_timed(*k, opts, "decrypt", summary, "", [&]{ k->decrypt_all_with_ring(); });
+  }
+  return 0;
+}
+
+static int cmd_re_encrypt(const Options& opts, Summary& summary)
+{
+  if (opts.s_newKey.empty()) throw std::runtime_error{"re-encrypt needs --new-key!"};
+  auto k{make_krenq(opts)};
+  // A fresh key is made if the new key isn't there yet, under the name
+  // it would be saved as.
+  std::string newKey{Krenq::key_filename(opts.s_newKey)};
+  if (!fs::exists(newKey)) k->save_key(opts.s_newKey);
+  summary.add("key", newKey);
+  run_timed(*k, opts, "re-encrypt", summary, "", [&]{ k->rekey(single_key(opts), newKey); });
+  return 0;
+}
+
+static int cmd_keygen(const Options& opts, Summary& summary)
+{
+  if (opts.s_paths.empty()) throw std::runtime_error{"No key names given!"};
+  auto start{std::chrono::steady_clock::now()};
+  Krenq::generate_keys(opts.s_paths);
+  double elapsed{std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+  char secs[32]{};
+  std::snprintf(secs, sizeof(secs), "%.3f", elapsed);
+  summary.add("keys", static_cast<std::uint64_t>(opts.s_paths.size()));
+  summary.add_raw("seconds", secs, secs);
+  return 0;
+}
+
+static int cmd_status(const Options& opts, Summary& summary)
+{
+  static const char* formats[]{"plain", "classic", "chunked", "deduplicated"};
+  auto k{make_krenq(opts)};
+  std::vector<Krenq::FileStatus> statuses{};
+  run_timed(*k, opts, "status", summary, "", [&]{ statuses = k->status_all(); });
+  std::uint64_t plain{};
+  std::uint64_t plainBytes{};
+  std::uint64_t encryptedBytes{};
+  std::string json{"["};
+  std::string text{};
+  for (auto& status : statuses)
+  {
+    bool encrypted{status.s_format != Krenq::Format::plain};
+    plain += !encrypted;
+    (encrypted ? encryptedBytes : plainBytes) += status.s_size;
+    if (!opts.s_list) continue;
+    const char* format{formats[static_cast<int>(status.s_format)]};
+    if (json.size() > 1) json += ',';
+    json += "{\"path\":" + Summary::quote(status.s_path);
+    json += ",\"format\":\"" + std::string{format} + "\"";
+    json += ",\"size\":" + std::to_string(status.s_size);
+    json += ",\"key_hash\":" + Summary::quote(status.s_keyHash) + "}";
+    text += "\n  " + std::string{format} + " " + (encrypted ? status.s_keyHash.substr(0, 16) : std::string(16, '-')) + " " + status.s_path;
+  }
+  summary.add("plain", plain);
+  summary.add("encrypted", statuses.size() - plain);
+  summary.add_raw("plain_bytes", std::to_string(plainBytes), human_bytes(static_cast<double>(plainBytes)));
+  summary.add_raw("encrypted_bytes", std::to_string(encryptedBytes), human_bytes(static_cast<double>(encryptedBytes)));
+  if (opts.s_list) summary.add_raw("list", json + "]", text);
+  return 0;
+}
+
+static int cmd_verify(const Options& opts, Summary& summary)
+{
+  auto k{make_krenq(opts)};
+  Krenq::VerifyReport report{};
+  run_timed(*k, opts, "verify", summary, "", [&]{ report = k->verify_all(single_key(opts)); });
+  summary.add("intact", report.s_intact);
+  summary.add("corrupted", report.s_corrupted);
+  summary.add("skipped", report.s_skipped);
+  summary.add("corrupted_files", report.s_corruptedFiles);
+  return report.s_corrupted > 0 ? g_exitCorrupted : 0;
+}
+
+//
+// Sweep chunk store of files under paths. Every file using the store
+// has to be under them, with its key given.
+//
+static int cmd_sweep(const Options& opts, Summary& summary)
+{
+  if (opts.s_dedup.empty()) throw std::runtime_error{"sweep needs --dedup!"};
+  if (opts.s_keys.empty()) throw std::runtime_error{"sweep needs at least one --key!"};
+  auto k{make_krenq(opts)};
+  k->load_key_ring(opts.s_keys);
+  Krenq::SweepReport report{};
+  run_timed(*k, opts, "sweep", summary, "", [&]{ report = k->sweep_store(); });
+  summary.add("kept_chunks", report.s_kept);
+  summary.add("removed_chunks", report.s_removed);
+  summary.add_raw("removed_bytes", std::to_string(report.s_bytes), human_bytes(static_cast<double>(report.s_bytes)));
+  return 0;
+}
+
+// Write given file and drop it from page cache, so reads hit the device.
+static void write_bench_file(const std::string& path, std::uint64_t size, std::mt19937_64& rng)
+{
+  int fd{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+  if (fd < 0) throw std::runtime_error{"Failed to create " + path + "!"};
+  std::vector<std::uint64_t> buf(128 * 1024);
+  for (std::uint64_t done{}; done < size;)
+  {
+    for (auto& word : buf) word = rng();
+    size_t n{static_cast<size_t>(std::min<std::uint64_t>(size - done, buf.size() * sizeof(std::uint64_t)))};
+    if (write(fd, buf.data(), n) != static_cast<ssize_t>(n))
+    {
+      close(fd);
+      throw std::runtime_error{"Failed to write " + path + "!"};
+    }
+    done += n;
+  }
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+//
+// Return where data extents of a sparse bench file of given size go:
+// spread evenly, with the last one ending at the last byte so the
+// largest offsets are always crossed.
+//
+static std::vector<std::uint64_t> sparse_offsets(std::uint64_t size)
+{
+  std::uint64_t count{std::min(g_sparseExtents, size / g_sparseExtent)};
+  if (count == 0) throw std::runtime_error{"Sparse bench files need at least 1 MiB!"};
+  std::vector<std::uint64_t> offsets{};
+  std::uint64_t stride{size / count};
+  for (std::uint64_t i{}; i + 1 < count; ++i) offsets.emplace_back(i * stride / 4096 * 4096);
+  offsets.emplace_back(size - g_sparseExtent);
+  return offsets;
+}
+
+// Fill buf with data of given part of given file, the same every time.
+static void bench_data(std::vector<unsigned char>& buf, std::uint64_t seed, size_t file, size_t extent)
+{
+  std::seed_seq seq{static_cast<std::uint32_t>(seed), static_cast<std::uint32_t>(seed >> 32),
+    static_cast<std::uint32_t>(file), static_cast<std::uint32_t>(extent)};
+  std::mt19937_64 rng{seq};
+  for (size_t i{}; i < buf.size(); i += sizeof(std::uint64_t))
+  {
+    std::uint64_t word{rng()};
+    std::memcpy(buf.data() + i, &word, std::min(sizeof(word), buf.size() - i));
+  }
+}
+
+// Make a sparse file of given size holding data extents only where sparse_offsets() puts them.
+static void write_sparse_file(const std::string& path, std::uint64_t size, std::uint64_t seed, size_t file)
+{
+  int fd{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+  if (fd < 0) throw std::runtime_error{"Failed to create " + path + "!"};
+  std::vector<unsigned char> buf(g_sparseExtent);
+  bool written{ftruncate(fd, static_cast<off_t>(size)) == 0};
+  std::vector<std::uint64_t> offsets{sparse_offsets(size)};
+  for (size_t e{}; written and e < offsets.size(); ++e)
+  {
+    bench_data(buf, seed, file, e);
+    written = pwrite(fd, buf.data(), buf.size(), static_cast<off_t>(offsets[e])) == static_cast<ssize_t>(buf.size());
+  }
+  written = written and fdatasync(fd) == 0;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  if (!written) throw std::runtime_error{"Failed to write " + path + "!"};
+}
+
+// Return true if a sparse file came back with its size and data extents as made.
+static bool check_sparse_file(const std::string& path, std::uint64_t size, std::uint64_t seed, size_t file)
+{
+  int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) return false;
+  struct stat st{};
+  bool intact{fstat(fd, &st) == 0 and static_cast<std::uint64_t>(st.st_size) == size};
+  std::vector<unsigned char> expected(g_sparseExtent);
+  std::vector<unsigned char> found(g_sparseExtent);
+  std::vector<std::uint64_t> offsets{sparse_offsets(size)};
+  for (size_t e{}; intact and e < offsets.size(); ++e)
+  {
+    bench_data(expected, seed, file, e);
+    intact = pread(fd, found.data(), found.size(), static_cast<off_t>(offsets[e])) == static_cast<ssize_t>(found.size()) and
+      found == expected;
+  }
+  close(fd);
+  return intact;
+}
+
+//
+// Fill buf with given version of a watch bench file. Classic format
+// takes trailing 0x1f bytes for padding, so no version ends in one.
+//
+static void version_data(std::vector<unsigned char>& buf, std::uint64_t seed, size_t file, size_t version)
+{
+  bench_data(buf, seed, file, version);
+  if (!buf.empty() and buf.back() == 0x1f) buf.back() = 0;
+}
+
+// Write given version of a watch bench file to path.
+static void write_version(const std::string& path, std::uint64_t size, std::uint64_t seed, size_t file, size_t version)
+{
+  std::vector<unsigned char> buf(size);
+  version_data(buf, seed, file, version);
+  int fd{open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+  bool written{fd >= 0 and write(fd, buf.data(), buf.size()) == static_cast<ssize_t>(buf.size())};
+  if (fd >= 0) close(fd);
+  if (!written) throw std::runtime_error{"Failed to write " + path + "!"};
+}
+
+// Return true if a watch bench file holds one of the versions written.
+static bool check_versions(const std::string& path, std::uint64_t size, std::uint64_t seed, size_t file)
+{
+  std::vector<unsigned char> found(size + 1);
+  int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) return false;
+  ssize_t n{pread(fd, found.data(), found.size(), 0)};
+  close(fd);
+  if (n != static_cast<ssize_t>(size)) return false;
+  found.resize(size);
+  std::vector<unsigned char> expected(size);
+  for (size_t version{}; version <= g_watchRounds; ++version)
+  {
+    version_data(expected, seed, file, version);
+    if (found == expected) return true;
+  }
+  return false;
+}
+
+//
+// Replace every file a few times over, renaming new versions in as
+// editors do, while watch mode encrypts them, then decrypt them all.
+// Files replaced while they are encrypted must still end up
+// encrypted once, as one of their versions, and none may fail.
+//
+static int bench_watch(const Options& opts, Summary& summary, const fs::path& dir, const fs::path& stage, const std::string& key, std::uint64_t seed)
+{
+  Krenq k{dir.string()};
+  configure(k, opts);
+  // Unless told otherwise, a file replaced while it's encrypted always
+  // finds a worker free to take it again.
+  if (opts.s_jobs == 0) k.set_device_concurrency(opts.s_hddJobs, 2 * opts.s_benchFiles);
+  k.save_key(key);
+  for (size_t version{1}; version <= g_watchRounds; ++version)
+    for (size_t f{}; f < opts.s_benchFiles; ++f)
+      write_version((stage / ("file" + std::to_string(f) + ".v" + std::to_string(version))).string(), opts.s_benchSize, seed, f, version);
+  // Workers don't report watched files as progress, only time is taken.
+  auto start{std::chrono::steady_clock::now()};
+  k.start_watch(std::chrono::milliseconds{0}, opts.s_benchFiles);
+  try
+  {
+    for (size_t version{1}; version <= g_watchRounds; ++version)
+    {
+      for (size_t f{}; f < opts.s_benchFiles; ++f)
+      {
+        std::string name{"file" + std::to_string(f) + ".v" + std::to_string(version)};
+        fs::rename(stage / name, dir / ("file" + std::to_string(f)));
+      }
+      // Long enough for workers to take the files, not to encrypt them.
+      std::this_thread::sleep_for(g_watchPause);
+    }
+  }
+  catch (...)
+  {
+    k.stop_watch();
+    throw;
+  }
+  Krenq::WatchReport report{k.stop_watch()};
+  char secs[32]{};
+  std::snprintf(secs, sizeof(secs), "%.3f", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  summary.add_raw("watch_seconds", secs, secs);
+  summary.add("encrypted", static_cast<std::uint64_t>(report.s_encrypted));
+  summary.add("failed", static_cast<std::uint64_t>(report.s_failed));
+  size_t plain{};
+  for (auto& file : k.status_all())
+    if (file.s_format == Krenq::Format::plain) ++plain;
+  k.decrypt_all(key);
+  bool intact{plain == 0 and report.s_failed == 0};
+  for (size_t f{}; f < opts.s_benchFiles; ++f)
+    intact = check_versions((dir / ("file" + std::to_string(f))).string(), opts.s_benchSize, seed, f) and intact;
+  summary.add("left_plain", static_cast<std::uint64_t>(plain));
+  summary.add_raw("intact", intact ? "true" : "false", intact ? "yes" : "no");
+  return intact ? 0 : g_exitCorrupted;
+}
+
+// Add heap allocations made by workers during an operation to summary.
+static void add_allocations(Summary& summary, const std::string& prefix, std::uint64_t allocations, size_t files)
+{
+  char perFile[32]{};
+  std::snprintf(perFile, sizeof(perFile), "%.2f", files > 0 ? static_cast<double>(allocations) / static_cast<double>(files) : 0.0);
+  summary.add_raw(prefix + "allocations", std::to_string(allocations), std::to_string(allocations) + " (" + perFile + " per file)");
+}
+
+//
+// Encrypt and decrypt a set of files of random data made under the
+// given directory, first through page cache and then with direct
+// I/O, and compare. Everything made is removed again.
+//
+// Heap allocations of workers are counted along the way. Workers
+// take their buffers and per file state from arenas kept by the
+// instance, so once a single worker has encrypted and decrypted all
+// files, doing it again must allocate nothing. This is checked after
+// the timed runs, and any allocation fails the bench.
+//
+// Sparse files are instead made of data extents spread over their
+// whole size, which may be far more than the disk holds. They are
+// encrypted and decrypted once, then checked against what was
+// written, so offsets past any 32-bit or floating point limit are
+// tested as well as timed.
+//
+// With --watch, files are replaced while watch mode encrypts them,
+// see bench_watch().
+//
+static int cmd_bench(const Options& opts, Summary& summary)
+{
+  if (opts.s_paths.size() > 1) throw std::runtime_error{"bench takes a single directory!"};
+  if (opts.s_sparse and opts.s_watch) throw std::runtime_error{"bench takes either --sparse or --watch!"};
+  fs::path base{fs::absolute(opts.s_paths.empty() ? "." : opts.s_paths.front())};
+  std::string tag{"krenq-bench-" + std::to_string(getpid())};
+  fs::path dir{base / tag};
+  fs::create_directories(dir);
+  std::vector<fs::path> made{dir};
+  int status{0};
+  try
+  {
+    std::uint64_t seed{std::random_device{}()};
+    std::mt19937_64 rng{seed};
+    for (size_t f{}; f < opts.s_benchFiles; ++f)
+    {
+      std::string path{(dir / ("file" + std::to_string(f))).string()};
+      if (opts.s_sparse) write_sparse_file(path, opts.s_benchSize, seed, f);
+      else if (opts.s_watch) write_version(path, opts.s_benchSize, seed, f, 0);
+      else write_bench_file(path, opts.s_benchSize, rng);
+    }
+    summary.add("files", static_cast<std::uint64_t>(opts.s_benchFiles));
+    summary.add_raw("file_size", std::to_string(opts.s_benchSize), human_bytes(static_cast<double>(opts.s_benchSize)));
+    if (opts.s_watch)
+    {
+      // New versions are made next to the directory, on the same
+      // filesystem, so they can be renamed in.
+      fs::path stage{base / (tag + "-stage")};
+      fs::create_directories(stage);
+      made.emplace_back(stage);
+      made.emplace_back(base / (tag + "-watch.krenq"));
+      status = bench_watch(opts, summary, dir, stage, made.back().string(), seed);
+    }
+    std::vector<std::string> modes{"buffered", "direct"};
+    if (opts.s_watch) modes.clear();
+    if (opts.s_sparse)
+    {
+      std::uint64_t data{sparse_offsets(opts.s_benchSize).size() * g_sparseExtent};
+      summary.add_raw("data_per_file", std::to_string(data), human_bytes(static_cast<double>(data)));
+      modes = {"sparse"};
+    }
+    for (auto& mode : modes)
+    {
+      Krenq k{dir.string()};
+      configure(k, opts);
+      k.set_direct_io(mode == "direct");
+      // Outside of the directory, or it'd be encrypted too.
+      std::string key{(base / (tag + "-" + mode + ".krenq")).string()};
+      k.save_key(key);
+      made.emplace_back(key);
+      std::uint64_t before{g_allocations};
+      run_timed(k, opts, mode + " encrypt", summary, mode + "_encrypt_", [&]{ k.encrypt_all(); });
+      add_allocations(summary, mode + "_encrypt_", g_allocations - before, opts.s_benchFiles);
+      before = g_allocations;
+      run_timed(k, opts, mode + " decrypt", summary, mode + "_decrypt_", [&]{ k.decrypt_all(key); });
+      add_allocations(summary, mode + "_decrypt_", g_allocations - before, opts.s_benchFiles);
+      // Warm up a single worker, then count what it allocates.
+      k.set_device_concurrency(1, 1);
+      k.encrypt_all();
+      k.decrypt_all(key);
+      before = g_allocations;
+      k.encrypt_all();
+      k.decrypt_all(key);
+      std::uint64_t steady{g_allocations - before};
+      summary.add(mode + "_steady_allocations", steady);
+      if (steady > 0 and status == 0) status = g_exitAllocations;
+    }
+    if (opts.s_sparse)
+    {
+      bool intact{true};
+      std::uint64_t allocated{};
+      for (size_t f{}; f < opts.s_benchFiles; ++f)
+      {
+        std::string path{(dir / ("file" + std::to_string(f))).string()};
+        intact = check_sparse_file(path, opts.s_benchSize, seed, f) and intact;
+        struct stat st{};
+        if (stat(path.c_str(), &st) == 0) allocated += static_cast<std::uint64_t>(st.st_blocks) * 512;
+      }
+      summary.add_raw("allocated_after", std::to_string(allocated), human_bytes(static_cast<double>(allocated)));
+      summary.add_raw("intact", intact ? "true" : "false", intact ? "yes" : "no");
+      if (!intact) status = g_exitCorrupted;
+    }
+  }
+  catch (...)
+  {
+    for (auto& path : made) fs::remove_all(path);
+    throw;
+  }
+  for (auto& path : made) fs::remove_all(path);
+  return status;
+}
+
+int main(int argc, char** argv)
+{
+  g_toolThread = true;
+  std::vector<std::pair<std::string, std::function<int(const Options&, Summary&)>>> commands
+  {
+    {"encrypt", cmd_encrypt},
+    {"decrypt", cmd_decrypt},
+    {"re-encrypt", cmd_re_encrypt},
+    {"status", cmd_status},
+    {"verify", cmd_verify},
+    {"sweep", cmd_sweep},
+    {"bench", cmd_bench},
+    {"keygen", cmd_keygen},
+  };
+  Options opts{};
+  try
+  {
+    opts = parse_options(argc, argv);
+  }
+  catch (const std::exception& e)
+  {
+    std::fprintf(stderr, "krenq: %s\nRun krenq --help for usage.\n", e.what());
+    return 1;
+  }
+  if (opts.s_command == "-h" or opts.s_command == "--help")
+  {
+    std::printf("%s", g_usage);
+    return 0;
+  }
+  auto command{std::find_if(commands.begin(), commands.end(), [&](const auto& c){ return c.first == opts.s_command; })};
+  if (command == commands.end())
+  {
+    std::fprintf(stderr, "krenq: Unknown command: %s!\n%s", opts.s_command.c_str(), g_usage);
+    return 1;
+  }
+  Summary summary{};
+  summary.add("command", opts.s_command);
+  int status{};
+  try
+  {
+    status = command->second(opts, summary);
+    summary.add_raw("ok", "true", "yes");
+  }
+  catch (const std::exception& e)
+  {
+    std::fprintf(stderr, "krenq: %s\n", e.what());
+    summary.add_raw("ok", "false", "no");
+    summary.add("error", std::string{e.what()});
+    status = 1;
+  }
+  summary.print(opts.s_json);
+  return status;
+}
@@ -8,23 +8,89 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <initializer_list>
 #include <iostream>
-#include <map>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
-#include <tuple>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 class Krenq
 {
+public:
+  /** I/O scheduling classes understood by the kernel. */
+  enum class IoClass : int { none = 0, realtime = 1, best_effort = 2, idle = 3 };
+  /** How far replaced files are made durable before moving on. */
+  enum class Durability { none, per_file, batched };
+  /** Outcome of verifying encrypted files against their plain data hash. */
+  struct VerifyReport
+  {
+    size_t s_intact{};
+    size_t s_corrupted{};
+    // Plain files and files encrypted with other keys.
+    size_t s_skipped{};
+    std::uint64_t s_bytes{};
+    std::vector<std::string> s_corruptedFiles{};
+  };
+  /** How an encrypted file is laid out. */
+  enum class Format { plain, classic, chunked, deduplicated };
+  /** Encryption state of a file, as read from its header and trailer. */
+  struct FileStatus
+  {
+    std::string s_path{};
+    Format s_format{Format::plain};
+    std::uint64_t s_size{};
+    // Hex of the keyhash of encrypted files, empty for plain ones.
+    std::string s_keyHash{};
+  };
+  /** Files and bytes of the running operation, done and in total. */
+  struct Progress
+  {
+    size_t s_files{};
+    size_t s_totalFiles{};
+    std::uint64_t s_bytes{};
+    std::uint64_t s_totalBytes{};
+  };
+  /** Outcome of watching entries. */
+  struct WatchReport
+  {
+    size_t s_encrypted{};
+    size_t s_failed{};
+  };
+  /** Outcome of sweeping chunk store. */
+  struct SweepReport
+  {
+    size_t s_kept{};
+    size_t s_removed{};
+    // Bytes of removed chunks.
+    std::uint64_t s_bytes{};
+  };
+  /** Plain data of a file read through plain cache. Stays valid for as long as it is held. */
+  struct PlainFile
+  {
+    std::shared_ptr<const void> s_owner{};
+    std::string_view s_data{};
+  };
+
 public:
   /** Initialize Krenq with list of entries. */
   Krenq(std::initializer_list<std::string>);
@@ -42,8 +108,36 @@ public:
   void remove_entries(Args...);
   /** Save generated key in specified file. */
   void save_key(const std::string&);
+  /** Generate a fresh key in each of the specified files, without needing an instance. */
+  static void generate_keys(const std::vector<std::string>&);
+  /** Return the name a key is saved under: keyname, with .krenq added unless it has it. */
+  static std::string key_filename(const std::string&);
   /** Return the number of entries that Krenq currently is managing. */
   size_t get_entry_size() const;
+  /** Limit read and write bandwidth (bytes/sec) and IOPS. Zero means unlimited. */
+  void set_io_limits(std::uint64_t, std::uint64_t, std::uint64_t = 0);
+  /** Run Krenq workers with given I/O class, I/O level and nice value. */
+  void set_io_priority(IoClass, int = 4, int = 0);
+  /** Set number of workers per rotational and per non-rotational device. */
+  void set_device_concurrency(size_t, size_t);
+  /** Bypass page cache with direct I/O when encrypting and decrypting. */
+  void set_direct_io(bool);
+  /** Set durability mode. Batches are committed every N files or M milliseconds. */
+  void set_durability(Durability, size_t = 1000, size_t = 1000);
+  /** Write chunked format with a hash per chunk of given size. Zero writes classic format. */
+  void set_chunk_size(size_t);
+  /** Compress files before encrypting them, skipping incompressible ones. */
+  void set_compression(bool);
+  /** Deduplicate plain data through a chunk store at given directory. Empty turns it off. */
+  void set_dedup(const std::string&);
+  /** Run no more workers than fit their buffers in given bytes. Zero means unlimited. */
+  void set_memory_limit(std::uint64_t);
+  /** Return progress of the running operation, safe to call from any thread. */
+  Progress get_progress() const;
+  /** Keep up to given bytes of files read with read_file() in memory, locked off swap if asked. Zero turns it off. */
+  void set_plain_cache(std::uint64_t, bool = false);
+  /** Back large worker buffers with huge pages where the system has them. */
+  void set_huge_pages(bool);
 
 public:
   /** Encrypt all entries that Krenq is currently managing. */
@@ -56,31 +150,361 @@ public:
   /** Decrypt entries by index. */
   template <typename... Args>
   void decrypt_by_index(const std::string&, Args...);
+  /** Load key files, or directories of them, into key ring. Throws if two different keys share a keyhash. */
+  void load_key_ring(const std::vector<std::string>&);
+  /** Decrypt all entries, picking the key of every file from key ring. */
+  void decrypt_all_with_ring();
   /** Re-encrypt all entries in runtime with the same key. */
   void re_encrypt_all();
   /** Re-encrypt entries by index. */
   template <typename... Args>
   void re_encrypt_by_index(Args...);
+  /** Move all entries from old key to new key in a single pass. */
+  void rekey(const std::string&, const std::string&);
+  /** Verify all entries encrypted with given key without writing anything. */
+  VerifyReport verify_all(const std::string&);
+  /** Return encryption state of all entries without reading any key. */
+  std::vector<FileStatus> status_all();
+  /** Delete chunks of chunk store no manifest under entries lists, reading manifests with key ring. */
+  SweepReport sweep_store();
+  /** Read and verify a range of plain data of a chunked file. */
+  std::string read_range(const std::string&, const std::string&, std::uint64_t, size_t);
+  /** Read and verify all plain data of an encrypted file, from plain cache while the file is unchanged. */
+  PlainFile read_file(const std::string&, const std::string&);
+  /** Encrypt files under entries as they are written, until stop_watch(). */
+  void start_watch(std::chrono::milliseconds = std::chrono::milliseconds{500}, size_t = 1024);
+  /** Stop watching, after encrypting files seen so far. */
+  WatchReport stop_watch();
 
 private:
+  struct TokenBucket;
+  struct FileJob;
+  struct DeviceQueue;
+  struct OutputFile;
+  struct KeyTile;
+  struct KeyCache;
+  struct ChunkHeader;
+  struct ManifestEntry;
+  struct Extent;
+  struct Watcher;
+  struct EStatus;
+  struct PlainBuffer;
+  struct PlainCache;
+  struct Arena;
   void generate_key();
-  bool encrypt(const std::string&);
-  bool decrypt(const std::string&, const std::string&);
-  bool re_encrypt(const std::string&);
+  bool encrypt(const FileJob&);
+  /** Hashes keyhashes, so key ring is looked up by view as well. */
+  struct KeyHashHash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+  };
+  typedef std::unordered_map<std::string, std::shared_ptr<const KeyTile>, KeyHashHash, std::equal_to<>> KeyRing;
+  enum class Verdict { skipped, intact, corrupted, deferred };
+  bool decrypt(const FileJob&, const KeyRing&);
+  bool re_encrypt(const FileJob&);
+  void remember_keys();
+  std::shared_ptr<const KeyTile> decrypted_key(const std::string&);
+  bool rekey_file(const FileJob&, const KeyTile&, const KeyTile&, const KeyTile&);
+  bool write_encrypted(const std::string&, std::uint64_t, const KeyTile&, const std::string&, const std::string&, const std::string&);
+  bool write_decrypted(const std::string&, std::uint64_t, const KeyTile&, const std::string&);
+  bool write_encrypted_direct(const std::string&, std::uint64_t, const KeyTile&, const std::string&, const std::string&, const std::string&);
+  bool write_decrypted_direct(const std::string&, std::uint64_t, const KeyTile&, const std::string&);
+  bool write_encrypted_chunked(const std::string&, std::uint64_t, const KeyTile&, const std::string&, const std::string&, const std::string&);
+  bool write_decrypted_chunked(const std::string&, std::uint64_t, const KeyTile&, const std::string&);
+  void pack_chunk_header(const ChunkHeader&, std::string&);
+  bool read_chunk_header(int, std::uint64_t, ChunkHeader&);
+  bool read_chunk_offsets(int, const ChunkHeader&, std::vector<std::uint64_t>&);
+  size_t read_chunk(int, const ChunkHeader&, const std::vector<std::uint64_t>&, const KeyTile&, size_t, unsigned char*);
+  size_t compress_chunk(const unsigned char*, size_t, unsigned char*, size_t);
+  size_t decompress_chunk(const unsigned char*, size_t, unsigned char*, size_t);
+  size_t merkle_nodes(size_t);
+  void merkle_leaf(const unsigned char*, size_t, char*);
+  void merkle_tree(char*, size_t);
+  bool merkle_check(int, std::uint64_t, size_t, size_t, const char*, const char*);
+  void pack_extent_map(std::uint64_t, const std::vector<Extent>&, std::string&);
+  bool read_extent_map(int, const ChunkHeader&, std::vector<Extent>&, std::uint64_t&, std::string&);
+  void seal_root(const char*, const std::string&, char*);
+  void find_extents(int, std::uint64_t, std::vector<Extent>&);
+  bool has_holes(const std::string&, std::uint64_t);
+  size_t find_packed(const std::vector<Extent>&, std::uint64_t);
+  size_t read_extents(int, const std::vector<Extent>&, unsigned char*, size_t, std::uint64_t);
+  void write_extents(OutputFile&, const std::vector<Extent>&, const unsigned char*, size_t, std::uint64_t);
+  bool verify_chunks(int, const ChunkHeader&, const std::vector<std::uint64_t>&, const std::string&, const KeyTile&, size_t, size_t);
+  void read_chunked(const std::string&, const EStatus&, const KeyTile&, std::uint64_t, std::uint64_t, const std::function<unsigned char*(std::uint64_t)>&);
+  std::shared_ptr<PlainBuffer> load_plain(const std::string&, const EStatus&, const KeyTile&);
+  bool write_encrypted_dedup(const std::string&, std::uint64_t, const KeyTile&, const std::string&, const std::string&, const std::string&);
+  bool write_decrypted_dedup(const std::string&, std::uint64_t, const KeyTile&, const std::string&);
+  bool rekey_manifest(const std::string&, std::uint64_t, const KeyTile&, const KeyTile&);
+  bool read_manifest(const std::string&, std::uint64_t, const KeyTile&, std::string&, std::vector<ManifestEntry>&);
+  void pack_manifest(std::uint64_t, const std::vector<ManifestEntry>&, const KeyTile&, std::string&);
+  void chunk_path(const std::array<char, 32>&, const KeyTile&, std::string&);
+  bool store_chunk(const unsigned char*, size_t, const std::array<char, 32>&, const KeyTile&);
+  void load_chunk(const ManifestEntry&, const KeyTile&, unsigned char*);
+  void apply_key(unsigned char*, size_t, std::uint64_t, const KeyTile&);
+  unsigned char* acquire_buffer();
+  void release_buffer(unsigned char*);
+  enum class ArenaSlot { input, output, compressed, matches, count };
+  Arena& arena();
+  static Arena*& held_arena();
+  Arena* acquire_arena();
+  void release_arena(Arena*);
+  unsigned char* arena_buffer(ArenaSlot, size_t);
+  void sync_output(int);
+  void commit_file(const std::string&, const std::string&);
+  void commit_chunk(const std::string&, const std::string&);
+  void flush_commits();
   void filter_indexes(std::vector<int>&);
   std::string get_string_hash(const std::string&);
-  std::string get_random_string(size_t, const std::string& = {});
-  long long get_randomN_from_limit(long long, long long);
-  std::uint32_t uint32_to_LittleEndian(std::uint32_t);
-  std::uint64_t uint64_to_LittleEndian(std::uint64_t);
-  std::string get_file_hash(const std::string&);
-  typedef std::tuple<bool, std::tuple<short, short, short>, size_t, std::string> type_estatus;
-  void krenq_status(const std::string&, Krenq::type_estatus&);
-  void add_padding(const std::string&, size_t = 0);
-  void remove_padding(const std::string&);
+  static std::string get_random_string(size_t, const std::string& = {});
+  static long long get_randomN_from_limit(long long, long long);
+  static void fill_random(void*, size_t);
+  static void fill_key(struct Key&);
+  static std::uint32_t uint32_to_LittleEndian(std::uint32_t);
+  static std::uint64_t uint64_to_LittleEndian(std::uint64_t);
+  EStatus krenq_status(const std::string&);
+  std::uint64_t padded_size(std::uint64_t);
+  size_t add_padding(unsigned char*, std::uint64_t);
+  size_t remove_padding(const unsigned char*);
   void make_prefix(std::string&, short = -1, short = -1 , short = -1);
-  void extract_key(const std::string&);
+  void make_chunked_prefix(std::string&);
+  bool is_chunked(const EStatus&);
+  void make_manifest_prefix(std::string&);
+  bool is_manifest(const EStatus&);
+  std::shared_ptr<const KeyTile> extract_key(const std::string&);
+  std::shared_ptr<const KeyTile> expand_key(const std::string&, const std::string&);
+  std::shared_ptr<const KeyTile> find_key(const std::string&);
+  void cache_key(const std::string&, const std::shared_ptr<const KeyTile>&);
   std::string getLocalDatetime();
+  void throttle(TokenBucket&, std::uint64_t);
+  void throttle_read(std::uint64_t);
+  void throttle_write(std::uint64_t);
+  void apply_io_priority();
+  size_t input_read(int, unsigned char*, size_t, std::uint64_t);
+  void output_open(OutputFile&, const std::string&, std::uint64_t, std::uint64_t);
+  void output_write(OutputFile&, const void*, size_t);
+  void output_flush(OutputFile&);
+  void output_seek(OutputFile&, std::uint64_t);
+  void output_close(OutputFile&, const std::string&);
+  void output_abort(OutputFile&, const std::string&);
+  std::vector<FileJob> walk_entries(const std::vector<std::string>&);
+  bool walk_directory(const std::string&, const std::pair<std::uint64_t, std::uint64_t>&, std::vector<FileJob>&, std::vector<std::string>&);
+  std::vector<DeviceQueue> plan_jobs(const std::vector<std::string>&);
+  void run_jobs(std::vector<DeviceQueue>&, const std::function<void(const FileJob&)>&);
+  bool is_rotational(std::uint64_t);
+  size_t worker_memory();
+  size_t memory_workers();
+  void balance_jobs(DeviceQueue&);
+  void encrypt_entries(const std::vector<std::string>&);
+  void decrypt_entries(const std::vector<std::string>&, const std::string&);
+  void decrypt_entries(const std::vector<std::string>&, const KeyRing&);
+  void re_encrypt_entries(const std::vector<std::string>&);
+  void rekey_entries(const std::vector<std::string>&, const std::string&, const std::string&);
+  VerifyReport verify_entries(const std::vector<std::string>&, const KeyRing&);
+  Verdict verify_file(const FileJob&, const KeyRing&, std::uint64_t&);
+  Verdict verify_tree(const std::string&, std::uint64_t, ChunkHeader&, std::string&, std::vector<std::uint64_t>&);
+  void watch_directory(const std::string&, bool);
+  void watch_tree(const std::string&, std::vector<std::string>*);
+  void watch_loop();
+  void watch_worker();
+
+private:
+  /** What header and trailer of a file tell. Trivially copyable. */
+  struct EStatus
+  {
+    bool s_encrypted{};
+    // Prefix pattern, suffix pattern and middle marker. Markers of
+    // chunked files come after classic ones, those of deduplicated
+    // files last.
+    short s_prefix{-1};
+    short s_suffix{-1};
+    short s_marker{-1};
+    std::uint64_t s_size{};
+    // Encrypted key hash found in trailer.
+    std::array<unsigned char, 32> s_keyHash{};
+    std::string_view key_hash() const { return {reinterpret_cast<const char*>(s_keyHash.data()), s_keyHash.size()}; }
+  };
+  /** Token bucket used to pace I/O. */
+  struct TokenBucket
+  {
+    std::atomic<std::uint64_t> s_rate{};
+    double s_tokens{};
+    std::chrono::steady_clock::time_point s_last{};
+    std::mutex s_mutex{};
+  };
+  /** Output file written in large extents aligned to file offset. */
+  struct OutputFile
+  {
+    int s_fd{-1};
+    // File offset of first buffered byte.
+    std::uint64_t s_offset{};
+    // Output buffer of the worker's arena.
+    unsigned char* s_buf{};
+    size_t s_used{};
+    // Bytes handed to writeback so far.
+    std::uint64_t s_written{};
+  };
+  /** A regular file found while walking entries. */
+  struct FileJob
+  {
+    std::string s_path{};
+    std::uint64_t s_dev{};
+    std::uint64_t s_ino{};
+    std::uint64_t s_size{};
+    // Fewer blocks than its size takes, so it may have holes.
+    bool s_sparse{};
+  };
+  /** Work found on a single block device. */
+  struct DeviceQueue
+  {
+    std::uint64_t s_dev{};
+    bool s_rotational{};
+    size_t s_workers{1};
+    // Each job is run back to back by a single worker.
+    std::vector<std::vector<FileJob>> s_jobs{};
+  };
+  /** Key expanded for XOR'ing whole buffers at once. Never changes once built. */
+  struct KeyTile
+  {
+    std::string s_key{};
+    // Hash of encrypted key, as found at the end of encrypted files.
+    std::string s_keyHash{};
+    // Key repeated over and over, starting at any phase.
+    std::vector<unsigned char> s_tile{};
+  };
+  /** Chunk header of a chunked file. */
+  struct ChunkHeader
+  {
+    std::uint8_t s_flags{};
+    std::uint32_t s_chunkSize{};
+    std::uint64_t s_plainSize{};
+    std::uint64_t s_bodySize{};
+    std::uint64_t s_tableSize{};
+    // Where body starts, follows from the sizes above.
+    std::uint64_t s_bodyOffset{};
+  };
+  /** Data extent of a sparse file. */
+  struct Extent
+  {
+    std::uint64_t s_offset{};
+    std::uint64_t s_length{};
+    // Where it starts among data extents alone.
+    std::uint64_t s_packed{};
+  };
+  /** A chunk of a deduplicated file. */
+  struct ManifestEntry
+  {
+    // Hash of plain chunk.
+    std::array<char, 32> s_id{};
+    std::uint32_t s_length{};
+  };
+  /** Extracted keys by hash of key file, least recently used first. */
+  struct KeyCache
+  {
+    struct Shard
+    {
+      std::mutex s_mutex{};
+      std::list<std::pair<std::string, std::shared_ptr<const KeyTile>>> s_lru{};
+      std::unordered_map<std::string, std::list<std::pair<std::string, std::shared_ptr<const KeyTile>>>::iterator> s_index{};
+    };
+    std::array<Shard, 8> s_shards{};
+  };
+  /** Plain data in memory of its own, wiped and unmapped once dropped. */
+  struct PlainBuffer
+  {
+    PlainBuffer(std::uint64_t, bool);
+    PlainBuffer(const PlainBuffer&) = delete;
+    PlainBuffer& operator=(const PlainBuffer&) = delete;
+    ~PlainBuffer();
+    unsigned char* s_data{};
+    std::uint64_t s_length{};
+    size_t s_mapped{};
+  };
+  /** Plain data of files read lately, least recently used first. */
+  struct PlainCache
+  {
+    struct Entry
+    {
+      // Path and keyhash.
+      std::string s_id{};
+      // What the encrypted file was when read, to tell when it changes.
+      std::uint64_t s_dev{};
+      std::uint64_t s_ino{};
+      std::uint64_t s_size{};
+      std::int64_t s_mtime{};
+      std::int64_t s_ctime{};
+      std::shared_ptr<const PlainBuffer> s_buffer{};
+    };
+    // Everything below is guarded by s_mutex.
+    std::mutex s_mutex{};
+    std::uint64_t s_budget{};
+    std::uint64_t s_bytes{};
+    bool s_locked{};
+    std::list<Entry> s_lru{};
+    std::unordered_map<std::string, std::list<Entry>::iterator> s_index{};
+  };
+  /**
+   * Scratch memory of a worker, reused from file to file, and from
+   * run to run through the arena pool, so that once warm, files
+   * allocate nothing. Buffers are page aligned and only ever grow.
+   * Strings and vectors are cleared before use, keeping their
+   * capacity; those holding paths start with room for any path.
+   */
+  struct Arena
+  {
+    Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+    std::array<unsigned char*, static_cast<size_t>(ArenaSlot::count)> s_buffers{};
+    std::array<size_t, static_cast<size_t>(ArenaSlot::count)> s_sizes{};
+    std::string s_prefix{};
+    std::string s_tempname{};
+    std::string s_header{};
+    std::string s_tree{};
+    std::string s_lengths{};
+    std::vector<std::uint64_t> s_offsets{};
+    std::vector<Extent> s_extents{};
+    std::string s_map{};
+    std::string s_manifest{};
+    std::string s_hash{};
+    std::vector<ManifestEntry> s_entries{};
+    std::string s_chunkPath{};
+    std::string s_chunkTemp{};
+    // Direct I/O writer, of a type direct I/O keeps to itself.
+    std::shared_ptr<void> s_directWriter{};
+  };
+  /** State of watch mode. */
+  struct Watcher
+  {
+    int s_fd{-1};
+    // Wakes up watching thread to stop.
+    int s_wakeFd{-1};
+    std::chrono::milliseconds s_debounce{};
+    // When watching started, in nanoseconds of file change time.
+    std::int64_t s_started{};
+    // Watched directories by watch descriptor, and whether all their files are taken.
+    std::unordered_map<int, std::pair<std::string, bool>> s_dirs{};
+    // Files among entries, watched through their directory.
+    std::unordered_set<std::string> s_files{};
+    // Files written lately, by when they are taken if left alone.
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> s_pending{};
+    std::thread s_thread{};
+    std::vector<std::thread> s_workers{};
+    // Everything below is guarded by s_mutex.
+    std::mutex s_mutex{};
+    std::condition_variable s_notEmpty{};
+    std::condition_variable s_notFull{};
+    std::deque<std::string> s_queue{};
+    // Files queued or being encrypted, and those of them taken again
+    // meanwhile, queued once more when their worker is done.
+    std::unordered_set<std::string> s_inFlight{};
+    std::unordered_set<std::string> s_parked{};
+    size_t s_capacity{};
+    size_t s_busy{};
+    bool s_stopping{};
+    WatchReport s_report{};
+  };
 
 private:
   /** Vector containing Krenq entries. */
@@ -93,10 +517,82 @@ private:
   struct Key* m_key;
   /** Encrypted key string. */
   std::string m_encryptedKey{};
-  // Map containing which entry was decrypted with which key.
-  std::map<std::string, std::string> m_emap{};
-  // Map containing key and encrypted keystring.
-  std::map<std::string, std::string> m_kenmap{};
+  /** Auto-generated key, expanded. */
+  std::shared_ptr<const KeyTile> m_keyTile{};
+  /** Keys extracted from key files. */
+  KeyCache m_keyCache{};
+  /** Keys loaded for decrypting, by keyhash. */
+  KeyRing m_keyRing{};
+  // Which entry was decrypted with which key, sorted by path.
+  std::vector<std::pair<std::string, std::shared_ptr<const KeyTile>>> m_emap{};
+  // Files decrypted by workers of a decrypt, merged into m_emap after.
+  std::vector<std::pair<const FileJob*, std::shared_ptr<const KeyTile>>> m_decrypted{};
+  // Guards m_emap and m_decrypted against concurrent workers.
+  std::mutex m_emutex{};
+  /** Read bandwidth limiter. */
+  TokenBucket m_readBucket{};
+  /** Write bandwidth limiter. */
+  TokenBucket m_writeBucket{};
+  /** I/O operations limiter. */
+  TokenBucket m_iopsBucket{};
+  /** I/O class of Krenq workers. */
+  IoClass m_ioclass{IoClass::none};
+  /** I/O level of Krenq workers within their class. */
+  int m_iolevel{4};
+  /** Nice value of Krenq workers. */
+  int m_niceness{0};
+  /** Number of workers per rotational device. */
+  size_t m_hddWorkers{1};
+  /** Number of workers per non-rotational device. */
+  size_t m_ssdWorkers{1};
+  /** Bytes all workers together may hold in buffers, zero if unlimited. */
+  std::uint64_t m_memoryLimit{0};
+  /** Files and bytes done by the running operation. */
+  std::atomic<size_t> m_doneFiles{0};
+  std::atomic<std::uint64_t> m_doneBytes{0};
+  /** Files and bytes the running operation started with. */
+  std::atomic<size_t> m_totalFiles{0};
+  std::atomic<std::uint64_t> m_totalBytes{0};
+  /** If page cache is bypassed. */
+  bool m_directIo{false};
+  /** Arenas of all workers so far, and those no worker holds. */
+  std::vector<std::unique_ptr<Arena>> m_arenas{};
+  std::vector<Arena*> m_freeArenas{};
+  /** Guards arena pool. */
+  std::mutex m_arenaMutex{};
+  /** Free aligned buffers for direct I/O. */
+  std::vector<unsigned char*> m_alignedBuffers{};
+  /** Guards m_alignedBuffers. */
+  std::mutex m_bufferMutex{};
+  /** Durability mode. */
+  Durability m_durability{Durability::none};
+  /** Number of files in a batch. */
+  size_t m_batchFiles{1000};
+  /** Longest time a batch stays open. */
+  std::chrono::milliseconds m_batchInterval{1000};
+  /** Temporary files waiting to replace their originals, up to m_pendingCount. Later ones keep their room. */
+  std::vector<std::pair<std::string, std::string>> m_pendingCommits{};
+  size_t m_pendingCount{0};
+  /** Devices synced by the batch being committed. */
+  std::vector<dev_t> m_syncedDevices{};
+  /** When the oldest pending commit was queued. */
+  std::chrono::steady_clock::time_point m_batchStart{};
+  /** Guards pending commits. */
+  std::mutex m_commitMutex{};
+  /** Chunk size of chunked format, zero for classic format. */
+  size_t m_chunkSize{0};
+  /** Whether files are compressed before being encrypted. */
+  bool m_compression{false};
+  /** Chunk store of deduplicated files, empty if off. */
+  std::string m_dedupStore{};
+  /** Number of temporary chunk files so far, to name them apart. */
+  std::atomic<std::uint64_t> m_chunkTemps{0};
+  /** Watch mode, null if not watching. */
+  std::unique_ptr<Watcher> m_watcher{};
+  /** Plain data of files read with read_file(). */
+  PlainCache m_plainCache{};
+  /** Whether large worker buffers try huge pages. */
+  bool m_hugePages{false};
 };
 
 template <typename... Args>
@@ -135,26 +631,10 @@ void Krenq::encrypt_by_index(Args... args)
   std::vector<int> vidx{indexes};
   this->filter_indexes(vidx);
 
-  // Encrypt by index.
-  for (auto i : vidx)
-  {
-    fs::path entry{m_entries[i - 1]};
-    if (!fs::exists(entry)) continue;
-    if (fs::is_regular_file(entry))
-    {
-      this->encrypt(entry.string());
-    }
-    //
-    // If entry is a directory, recurse through it and encrypt all
-    // its files.
-    //
-    else if (fs::is_directory(entry))
-      for (auto dfile : fs::recursive_directory_iterator(entry))
-        if (fs::is_regular_file(dfile))
-        {
-          this->encrypt(fs::path{dfile}.string());
-        }
-  }
+  // Collect entries by index.
+  std::vector<std::string> entries{};
+  for (auto i : vidx) entries.emplace_back(m_entries[i - 1]);
+  this->encrypt_entries(entries);
 }
 
 template <typename... Args>
@@ -164,24 +644,10 @@ void Krenq::decrypt_by_index(const std::string& keyname, Args... args)
   std::vector<int> vidx{indexes};
   this->filter_indexes(vidx);
 
-  // Decrypt by index.
-  for (auto i : vidx)
-  {
-    fs::path entry{m_entries[i - 1]};
-    if (!fs::exists(entry)) continue;
-    if (fs::is_regular_file(entry))
-    {
-      this->decrypt(entry.string(), keyname);
-    }
-    //
-    // If entry is a directory, recurse through it and encrypt all
-    // its files.
-    //
-    else if (fs::is_directory(entry))
-      for (auto dfile : fs::recursive_directory_iterator(entry))
-        if (fs::is_regular_file(dfile))
-          this->decrypt(fs::path{dfile}.string(), keyname);
-  }
+  // Collect entries by index.
+  std::vector<std::string> entries{};
+  for (auto i : vidx) entries.emplace_back(m_entries[i - 1]);
+  this->decrypt_entries(entries, keyname);
 }
 
 template <typename... Args>
@@ -191,26 +657,10 @@ void Krenq::re_encrypt_by_index(Args... args)
   std::vector<int> vidx{indexes};
   this->filter_indexes(vidx);
 
-  // Re-encrypt by index.
-  for (auto i : vidx)
-  {
-    fs::path entry{m_entries[i - 1]};
-    if (!fs::exists(entry)) continue;
-    if (!m_emap.contains(entry.string()))
-      continue;
-    if (fs::is_regular_file(entry))
-    {
-      this->re_encrypt(entry.string());
-    }
-    //
-    // If entry is a directory, recurse through it and encrypt all
-    // its files.
-    //
-    else if (fs::is_directory(entry))
-      for (auto dfile : fs::recursive_directory_iterator(entry))
-        if (fs::is_regular_file(dfile))
-          this->re_encrypt(fs::path{dfile}.string());
-  }
+  // Collect entries by index.
+  std::vector<std::string> entries{};
+  for (auto i : vidx) entries.emplace_back(m_entries[i - 1]);
+  this->re_encrypt_entries(entries);
 }
 
 /** 
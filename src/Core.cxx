@@ -5,11 +5,17 @@
  * See the LICENSE file for more information.
  */
 #include "krenq/Core.hxx"
-#include <cmath>
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <unistd.h>
 
 // Holds length of string in Key.
 static const int g_kslen{16};
@@ -51,17 +57,23 @@ typedef char type3;
 
 // Holds the length of actual key.
 static const size_t g_actualKlen{154};
+// Smallest possible encrypted file: header, manifest header, a single
+// manifest entry and trailer.
+static const size_t g_minEncryptedSize{32 + 12 + 1 + 12 + 24 + 36 + 32};
+// Size of header: plain file hash, pattern, marker, pattern.
+static const size_t g_headerSize{32 + 12 + 1 + 12};
+// Size of trailer: encrypted key hash.
+static const size_t g_keyHashSize{32};
+// Number of key-sized blocks read at once, about a MiB.
+static const size_t g_ioBlocks{6808};
 // Holds length of encrypted key.
 static const size_t g_encryptedKlen{sizeof(Key)};
-// Holds the actual key.
-static std::string g_actualKey{};
-// Map containing extracted key values.
-static std::map<std::string, std::string> g_kmap{};
 
 // Constructor.
 Krenq::Krenq(std::initializer_list<std::string> entries)
   : m_entries{entries},
-    m_key{new Key}
+    m_key{new Key},
+    m_ssdWorkers{std::max(1u, std::thread::hardware_concurrency())}
 {
   // New and unique key will be generated only when Krenq is
   // constructed.
@@ -71,7 +83,16 @@ Krenq::Krenq(std::initializer_list<std::string> entries)
 // Destructor.
 Krenq::~Krenq()
 {
+  try
+  {
+    this->stop_watch();
+    this->flush_commits();
+  }
+  catch (...)
+  {
+  }
   delete m_key;
+  for (auto buf : m_alignedBuffers) std::free(buf);
 }
 
 // Return number of entries in Krenq.
@@ -80,39 +101,56 @@ size_t Krenq::get_entry_size() const
   return m_entries.size();
 }
 
+// Pad actual key to g_actualKlen bytes by repeating it from its
+// start, as many times as it takes.
+static void pad_key(std::string& actualKey)
+{
+  while (actualKey.length() < g_actualKlen)
+    actualKey += actualKey.substr(0, g_actualKlen - actualKey.length());
+}
+
+// Fill key with fresh values. Numbers of all parts are taken in a
+// single draw.
+void Krenq::fill_key(Key& key)
+{
+  std::array<type2, 4> rt{};
+  type1 kid{};
+  Krenq::fill_random(rt.data(), sizeof(rt));
+  Krenq::fill_random(&kid, sizeof(kid));
+  key.s_kid = Krenq::uint32_to_LittleEndian(kid);
+  std::strncpy(key.s_ksport1, Krenq::get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
+  key.s_rt1 = Krenq::uint64_to_LittleEndian(rt[0]);
+  std::strncpy(key.s_ksport2, Krenq::get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
+  key.s_rt2 = Krenq::uint64_to_LittleEndian(rt[1]);
+  std::strncpy(key.s_ksport3, Krenq::get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
+  key.s_rt3 = Krenq::uint64_to_LittleEndian(rt[2]);
+  std::strncpy(key.s_ksport4, Krenq::get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
+  key.s_rt4 = Krenq::uint64_to_LittleEndian(rt[3]);
+}
+
 // Generates a unique key.
 void Krenq::generate_key()
 {
-  // Generate values to populate m_key.
-  std::srand(std::time(nullptr));
-  m_key->s_kid = this->uint32_to_LittleEndian(static_cast<type1>((std::rand())));
-  std::strncpy(m_key->s_ksport1, this->get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
-  m_key->s_rt1 = this->uint64_to_LittleEndian(static_cast<type2>(std::rand()));
-  std::strncpy(m_key->s_ksport2, this->get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
-  m_key->s_rt2 = this->uint64_to_LittleEndian(static_cast<type2>(std::rand()));
-  std::strncpy(m_key->s_ksport3, this->get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
-  m_key->s_rt3 = this->uint64_to_LittleEndian(static_cast<type2>(std::rand()));
-  std::strncpy(m_key->s_ksport4, this->get_random_string(g_kslen - 1).c_str(), g_kslen - 1);
-  m_key->s_rt4 = this->uint64_to_LittleEndian(static_cast<type2>(std::rand()));
+  this->fill_key(*m_key);
 
   // Make the actual key.
-  g_actualKey += std::to_string(m_key->s_kid);
-  g_actualKey += m_key->s_ksport1;
-  g_actualKey += std::to_string(m_key->s_rt1);
-  g_actualKey += m_key->s_ksport2;
-  g_actualKey += std::to_string(m_key->s_rt2);
-  g_actualKey += m_key->s_ksport3;
-  g_actualKey += std::to_string(m_key->s_rt3);
-  g_actualKey += m_key->s_ksport4;
-  g_actualKey += std::to_string(m_key->s_rt4);
+  std::string actualKey{};
+  actualKey += std::to_string(m_key->s_kid);
+  actualKey += m_key->s_ksport1;
+  actualKey += std::to_string(m_key->s_rt1);
+  actualKey += m_key->s_ksport2;
+  actualKey += std::to_string(m_key->s_rt2);
+  actualKey += m_key->s_ksport3;
+  actualKey += std::to_string(m_key->s_rt3);
+  actualKey += m_key->s_ksport4;
+  actualKey += std::to_string(m_key->s_rt4);
   
   // Due to assoication of random numbers in g_actualKstr, the
   // random numbers wouldn't always be of their maximum size and
   // as a result the string wouldn't be of it's maximum length
   // (which is 154) too. So g_actualKstr should be padded. Add
   // padding at the end of g_actualKstr to make it 154 bytes long.
-  size_t diff{g_actualKlen - g_actualKey.length()};
-  g_actualKey += g_actualKey.substr(0, diff);
+  pad_key(actualKey);
 
   // Write raw binary format of Key to m_encryptedKstr. It has to
   // be ensured first that Key is packed and the internal data is
@@ -120,6 +158,34 @@ void Krenq::generate_key()
   std::stringstream obuffer;
   obuffer.write(reinterpret_cast<char*>(m_key), sizeof(Key));
   m_encryptedKey = obuffer.str();
+  m_keyTile = this->expand_key(actualKey, m_encryptedKey);
+}
+
+// Generates a fresh key in each given file. No instance is needed, so
+// none generates a key of its own on the way. All names are checked
+// before any key is written.
+void Krenq::generate_keys(const std::vector<std::string>& keynames)
+{
+  std::vector<std::string> files{};
+  files.reserve(keynames.size());
+  for (auto& keyname : keynames)
+  {
+    files.emplace_back(Krenq::key_filename(keyname));
+    if (fs::exists(files.back())) throw std::runtime_error{"Key already exists! Choose a unique name!"};
+  }
+  std::vector<std::string> sorted{files};
+  std::sort(sorted.begin(), sorted.end());
+  if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+    throw std::runtime_error{"Copies of same key cannot be generated even in different files!"};
+
+  std::vector<Key> keys(files.size());
+  for (auto& key : keys) Krenq::fill_key(key);
+  for (size_t i{}; i < files.size(); ++i)
+  {
+    std::fstream ofile{files[i], std::ios::out | std::ios::binary};
+    ofile.write(reinterpret_cast<const char*>(&keys[i]), sizeof(Key));
+    if (!ofile) throw std::runtime_error{"Cannot write key " + files[i] + "!"};
+  }
 }
 
 //
@@ -128,103 +194,203 @@ void Krenq::generate_key()
 // encrypt. So do any pre-encryption steps beforehand.
 // return true would mean entry has been successfully encrypted.
 //
-bool Krenq::encrypt(const std::string& filename)
+bool Krenq::encrypt(const Krenq::FileJob& file)
 {
-  Krenq::type_estatus estatus{};
-  this->krenq_status(filename, estatus);
+  // No need to encrypt files that were empty when walked.
+  if (file.s_size == 0) return false;
+  const std::string& filename{file.s_path};
+  Krenq::EStatus estatus{this->krenq_status(filename)};
   // If file is already encrypted, no need to encrypt.
-  if (std::get<0>(estatus)) return false;
+  if (estatus.s_encrypted) return false;
   // No need to encrypt empty files.
-  size_t filesize{std::get<2>(estatus)};
+  std::uint64_t filesize{estatus.s_size};
   if (filesize == 0) return false;
   // Past this point, we gotta encrypt the file.
-  // Get the original file hash first.
-  std::string filehash{this->get_file_hash(filename)};
-  // Create a random prefix.
-  std::string prefix{};
-  this->make_prefix(prefix);
+  // Create a random prefix. It and the name of the temporary file are
+  // kept in the arena of this worker.
+  std::string& prefix{this->arena().s_prefix};
+  std::string& tempname{this->arena().s_tempname};
+  tempname.assign(filename);
+  tempname += ".krenqenctemp";
   // Get encrypted key hash.
-  std::string kenhash{this->get_string_hash(m_encryptedKey)};
-  // Add padding to the file.
-  this->add_padding(filename, filesize);
-  // Create temporary file to write data.
-  std::fstream ofile{filename + ".krenqenctemp", std::ios::out | std::ios::binary};
-  ofile << filehash << prefix;
-  // Open original file for reading.
-  std::fstream ifile{filename, std::ios::in | std::ios::binary};
-  // Read the original file and write encryption data in the temporary file.
-  std::array<unsigned char, g_actualKlen> ibuf{};
-  size_t idx1{0};
-  size_t immediateMultiple{static_cast<int>(std::ceil(filesize / static_cast<double>(g_actualKlen))) * g_actualKlen};
-  for (size_t i{}; i < immediateMultiple / g_actualKlen; ++i)
+  const std::string& kenhash{m_keyTile->s_keyHash};
+  if (!m_dedupStore.empty())
+  {
+    this->make_manifest_prefix(prefix);
+    return this->write_encrypted_dedup(filename, filesize, *m_keyTile, prefix, kenhash, tempname);
+  }
+  if (m_chunkSize > 0 or m_compression or (file.s_sparse and this->has_holes(filename, filesize)))
+  {
+    this->make_chunked_prefix(prefix);
+    return this->write_encrypted_chunked(filename, filesize, *m_keyTile, prefix, kenhash, tempname);
+  }
+  this->make_prefix(prefix);
+  if (m_directIo)
+    return this->write_encrypted_direct(filename, filesize, *m_keyTile, prefix, kenhash, tempname);
+  return this->write_encrypted(filename, filesize, *m_keyTile, prefix, kenhash, tempname);
+}
+
+//
+// Write encrypted form of a plain file and replace the file with it.
+//
+// The plain file is read once. Its hash is taken on the way and
+// written into the header last, and padding is added in memory, so
+// the plain file is never written to. The output is preallocated to
+// its exact size up front. Pages of the plain file are dropped from
+// page cache right after they are read.
+//
+bool Krenq::write_encrypted(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& prefix, const std::string& kenhash, const std::string& tempname)
+{
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::uint64_t immediateMultiple{this->padded_size(filesize)};
+  Krenq::OutputFile ofile{};
+  try
   {
-    ifile.seekg(idx1);
-    ifile.read(reinterpret_cast<char*>(ibuf.data()), g_actualKlen);
-    std::string temp{};
-    temp.reserve(g_actualKlen);
-    std::string key{g_actualKey};
-    for (size_t i{}; i < g_actualKlen; ++i)
+    this->output_open(ofile, tempname, g_headerSize + immediateMultiple + g_keyHashSize, g_headerSize);
+    struct Sha_256 sha_256;
+    std::array<std::uint8_t, 32> sha256Hash{};
+    sha_256_init(&sha_256, sha256Hash.data());
+    unsigned char* ibuf{this->arena_buffer(Krenq::ArenaSlot::input, g_ioBlocks * g_actualKlen)};
+    for (std::uint64_t offset{}; offset < filesize;)
     {
-      temp += ibuf[i] xor key[i];
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(g_ioBlocks * g_actualKlen, filesize - offset))};
+      if (this->input_read(ifd, ibuf, n, offset) != n)
+        throw std::runtime_error{"File shrank while being encrypted: " + filename};
+      sha_256_write(&sha_256, ibuf, n);
+      if (offset + n == filesize) n += this->add_padding(ibuf + n, filesize);
+      this->apply_key(ibuf, n, offset, key);
+      this->output_write(ofile, ibuf, n);
+      offset += n;
     }
-    ofile << temp;
-    idx1 += g_actualKlen;
+    this->output_write(ofile, kenhash.data(), kenhash.size());
+    sha_256_close(&sha_256);
+    std::string& header{this->arena().s_header};
+    header.assign(reinterpret_cast<const char*>(sha256Hash.data()), sha256Hash.size());
+    header += prefix;
+    this->output_close(ofile, header);
   }
-  ofile << kenhash;
-  ifile.close();
-  ofile.close();
+  catch (...)
+  {
+    close(ifd);
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  close(ifd);
   // Overwrite original file with temporary file.
-  fs::rename(fs::path{filename + ".krenqenctemp"}, fs::path{filename.c_str()});
+  this->commit_file(tempname, filename);
   return true;
 }
 
 //
-// This would expect only a single valid file and a key. Rules are
-// same as the encrypt() function.
+// This would expect only a single valid file and a key ring. Rules
+// are same as the encrypt() function.
 //
-// Extract the keydata from key filename. Then check the status of
-// the file. Check if provided keyhash matches with file keyhash.
-// Create temporary file to write decrypted file data. Read encrypted
-// file and write decrypted data to temporary file. Replace temporary
-// file with original file.
+// Check the status of the file. Look up the key of the file by the
+// keyhash found in it. Create temporary file to write decrypted file
+// data. Read encrypted file and write decrypted data to temporary
+// file. Replace temporary file with original file.
 //
-bool Krenq::decrypt(const std::string& filename, const std::string& keyname)
-{
-  this->extract_key(keyname);
-  if (!g_kmap.contains(keyname))
-    throw std::runtime_error{"Key extraction failed!"};
-  Krenq::type_estatus estatus{};
-  this->krenq_status(filename, estatus);
-  if (!std::get<0>(estatus)) return false;
-  std::string ekstrHash{this->get_string_hash(m_kenmap[keyname])};
-  std::string fileKeyHash{std::get<3>(estatus)};
-  if (ekstrHash != fileKeyHash)
+bool Krenq::decrypt(const Krenq::FileJob& file, const Krenq::KeyRing& ring)
+{
+  // Files smaller than an encrypted header and trailer are plain.
+  if (file.s_size < g_minEncryptedSize) return false;
+  const std::string& filename{file.s_path};
+  Krenq::EStatus estatus{this->krenq_status(filename)};
+  if (!estatus.s_encrypted) return false;
+  auto found{ring.find(estatus.key_hash())};
+  if (found == ring.end())
     return false;
-  std::fstream ifile{filename, std::ios::in | std::ios::binary};
-  std::fstream ofile{filename + ".krenqdectemp", std::ios::out | std::ios::binary};
-  std::array<unsigned char, g_actualKlen> fbuf{};
-  size_t filesize{std::get<2>(estatus)};
-  size_t nIter{(filesize - (32 * 2 + 25)) / g_actualKlen};
-  size_t ifpos{32 + 25};
-  ifile.seekg(ifpos, std::ios::beg);
-  std::string portion{};
-  portion.reserve(g_actualKlen);
-  for (size_t i{}; i < nIter; ++i)
+  const std::shared_ptr<const Krenq::KeyTile>& key{found->second};
+  std::string& tempname{this->arena().s_tempname};
+  tempname.assign(filename);
+  tempname += ".krenqdectemp";
+  bool written{this->is_manifest(estatus) ?
+    this->write_decrypted_dedup(filename, estatus.s_size, *key, tempname) : this->is_chunked(estatus) ?
+    this->write_decrypted_chunked(filename, estatus.s_size, *key, tempname) : m_directIo ?
+    this->write_decrypted_direct(filename, estatus.s_size, *key, tempname) :
+    this->write_decrypted(filename, estatus.s_size, *key, tempname)};
+  if (!written) return false;
+  std::lock_guard<std::mutex> lock{m_emutex};
+  m_decrypted.emplace_back(&file, key);
+  return true;
+}
+
+//
+// Merge keys of files decrypted by the last decrypt into the map of
+// decrypted files. Workers only add to room reserved up front, so
+// decrypting allocates nothing per file once paths are known.
+//
+void Krenq::remember_keys()
+{
+  std::lock_guard<std::mutex> lock{m_emutex};
+  size_t known{m_emap.size()};
+  for (auto& [file, key] : m_decrypted)
+  {
+    auto iter{std::lower_bound(m_emap.begin(), m_emap.begin() + known, file->s_path,
+      [](const auto& e, const std::string& path){ return e.first < path; })};
+    if (iter != m_emap.begin() + known and iter->first == file->s_path) iter->second = key;
+    else m_emap.emplace_back(file->s_path, key);
+  }
+  m_decrypted.clear();
+  if (m_emap.size() == known) return;
+  std::sort(m_emap.begin(), m_emap.end(), [](const auto& a, const auto& b){ return a.first < b.first; });
+  m_emap.erase(std::unique(m_emap.begin(), m_emap.end(), [](const auto& a, const auto& b){ return a.first == b.first; }), m_emap.end());
+}
+
+// Key a file was decrypted with in this runtime, if it was.
+std::shared_ptr<const Krenq::KeyTile> Krenq::decrypted_key(const std::string& filename)
+{
+  std::lock_guard<std::mutex> lock{m_emutex};
+  auto iter{std::lower_bound(m_emap.begin(), m_emap.end(), filename,
+    [](const auto& e, const std::string& path){ return e.first < path; })};
+  if (iter == m_emap.end() or iter->first != filename) return nullptr;
+  return iter->second;
+}
+
+//
+// Write decrypted form of an encrypted file and replace the file
+// with it. The last block is decrypted first to learn the amount of
+// padding, so the output is preallocated to its exact size and the
+// padding is simply never written.
+//
+bool Krenq::write_decrypted(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& tempname)
+{
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::uint64_t nIter{(filesize - (g_headerSize + g_keyHashSize)) / g_actualKlen};
+  std::uint64_t bodysize{nIter * g_actualKlen};
+  Krenq::OutputFile ofile{};
+  try
   {
-    ifile.read(reinterpret_cast<char*>(fbuf.data()), g_actualKlen);
-    for (size_t j{}; j < g_actualKlen; ++j)
+    std::array<unsigned char, g_actualKlen> last{};
+    if (pread(ifd, last.data(), g_actualKlen, g_headerSize + bodysize - g_actualKlen) != static_cast<ssize_t>(g_actualKlen))
+      throw std::runtime_error{"Failed to read " + filename};
+    this->apply_key(last.data(), g_actualKlen, 0, key);
+    std::uint64_t plainsize{bodysize - this->remove_padding(last.data())};
+    this->output_open(ofile, tempname, plainsize, 0);
+    unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, g_ioBlocks * g_actualKlen)};
+    for (std::uint64_t offset{}; offset < plainsize;)
     {
-      portion += fbuf[j] xor g_kmap[keyname][j];
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(g_ioBlocks * g_actualKlen, bodysize - offset))};
+      if (this->input_read(ifd, fbuf, n, g_headerSize + offset) != n)
+        throw std::runtime_error{"File shrank while being decrypted: " + filename};
+      this->apply_key(fbuf, n, offset, key);
+      this->output_write(ofile, fbuf, static_cast<size_t>(std::min<std::uint64_t>(n, plainsize - offset)));
+      offset += n;
     }
-    ofile << portion;
-    portion = {};
-    ifpos += g_actualKlen;
+    this->output_close(ofile, {});
   }
-  ifile.close();
-  ofile.close();
-  fs::rename(fs::path{filename + ".krenqdectemp"}, fs::path{filename.c_str()});
-  this->remove_padding(filename);
-  m_emap[filename] = keyname;
+  catch (...)
+  {
+    close(ifd);
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  close(ifd);
+  this->commit_file(tempname, filename);
   return true;
 }
 
@@ -236,194 +402,367 @@ bool Krenq::decrypt(const std::string& filename, const std::string& keyname)
 // accesses the key has been extracted by decrypt() and uses it to
 // encrypt file.
 //
-bool Krenq::re_encrypt(const std::string& filename)
+bool Krenq::re_encrypt(const Krenq::FileJob& file)
 {
-  Krenq::type_estatus estatus{};
-  this->krenq_status(filename, estatus);
-  if (std::get<0>(estatus) == true) return false;
-  size_t filesize{std::get<2>(estatus)};
+  if (file.s_size == 0) return false;
+  const std::string& filename{file.s_path};
+  Krenq::EStatus estatus{this->krenq_status(filename)};
+  if (estatus.s_encrypted == true) return false;
+  std::uint64_t filesize{estatus.s_size};
   if (filesize == 0) return false;
-  std::string filehash{this->get_file_hash(filename)};
-  std::string prefix{};
-  this->make_prefix(prefix);
-  std::string keyname{m_emap[filename]};
-  std::string kstr{g_kmap[keyname]};
-  std::string kenstr{m_kenmap[keyname]};
-  std::string kenhash{this->get_string_hash(kenstr)};
-  this->add_padding(filename, filesize);
-  std::fstream ofile{filename + ".krenqrcrypttemp", std::ios::out | std::ios::binary};
-  ofile << filehash << prefix;
-  std::fstream ifile{filename, std::ios::in | std::ios::binary};
-  std::array<unsigned char, g_actualKlen> ibuf{};
-  size_t idx1{0};
-  size_t immediateMultiple{static_cast<int>(std::ceil(filesize / static_cast<double>(g_actualKlen))) * g_actualKlen};
-  for (size_t i{}; i < immediateMultiple / g_actualKlen; ++i)
+  std::string& prefix{this->arena().s_prefix};
+  std::string& tempname{this->arena().s_tempname};
+  tempname.assign(filename);
+  tempname += ".krenqrcrypttemp";
+  std::shared_ptr<const Krenq::KeyTile> key{this->decrypted_key(filename)};
+  if (!key) return false;
+  if (!m_dedupStore.empty())
   {
-    ifile.seekg(idx1);
-    ifile.read(reinterpret_cast<char*>(ibuf.data()), g_actualKlen);
-    std::string temp{};
-    temp.reserve(g_actualKlen);
-    std::string key{g_kmap[keyname]};
-    for (size_t i{}; i < g_actualKlen; ++i)
-    {
-      temp += ibuf[i] xor key[i];
-    }
-    ofile << temp;
-    idx1 += g_actualKlen;
+    this->make_manifest_prefix(prefix);
+    return this->write_encrypted_dedup(filename, filesize, *key, prefix, key->s_keyHash, tempname);
   }
-  ofile << kenhash;
-  ifile.close();
-  ofile.close();
-  fs::rename(fs::path{filename + ".krenqrcrypttemp"}, fs::path{filename.c_str()});
-  return true;
+  if (m_chunkSize > 0 or m_compression or (file.s_sparse and this->has_holes(filename, filesize)))
+  {
+    this->make_chunked_prefix(prefix);
+    return this->write_encrypted_chunked(filename, filesize, *key, prefix, key->s_keyHash, tempname);
+  }
+  this->make_prefix(prefix);
+  if (m_directIo)
+    return this->write_encrypted_direct(filename, filesize, *key, prefix, key->s_keyHash, tempname);
+  return this->write_encrypted(filename, filesize, *key, prefix, key->s_keyHash, tempname);
 }
 
-// Encrypt all entries in Krenq.
-void Krenq::encrypt_all()
+//
+// Move a single file to the new key. Files which aren't encrypted
+// with the old key are left alone, so an interrupted rekey can be
+// run again. Everything ahead of the body, plain file hash and chunk
+// tables alike, is kept, the patterns get drawn anew and the trailer
+// names the new key. Deduplicated files have their chunks stored
+// under the new key instead.
+//
+bool Krenq::rekey_file(const Krenq::FileJob& file, const Krenq::KeyTile& oldKey, const Krenq::KeyTile& newKey, const Krenq::KeyTile& combinedKey)
 {
-  if (!m_keyIsSaved)
+  const std::string& filename{file.s_path};
+  const std::string& newHash{newKey.s_keyHash};
+  Krenq::EStatus estatus{this->krenq_status(filename)};
+  if (!estatus.s_encrypted or estatus.key_hash() != oldKey.s_keyHash) return false;
+  std::uint64_t filesize{estatus.s_size};
+  if (this->is_manifest(estatus)) return this->rekey_manifest(filename, filesize, oldKey, newKey);
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  bool chunked{this->is_chunked(estatus)};
+  std::uint64_t bodyOffset{g_headerSize};
+  Krenq::ChunkHeader chunkHeader{};
+  if (chunked and this->read_chunk_header(ifd, filesize, chunkHeader))
+    bodyOffset = chunkHeader.s_bodyOffset;
+  std::uint64_t bodysize{filesize - bodyOffset - g_keyHashSize};
+  if ((chunked and bodyOffset == g_headerSize) or (!chunked and (bodysize == 0 or bodysize % g_actualKlen != 0)))
   {
-    throw std::runtime_error{"Save the key using save_key() before trying to encrypt anything!"};
+    close(ifd);
+    return false;
   }
-  for (auto e : m_entries)
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::string& tempname{this->arena().s_tempname};
+  tempname.assign(filename);
+  tempname += ".krenqrekeytemp";
+  Krenq::OutputFile ofile{};
+  try
   {
-    fs::path entry{e};
-    if (!fs::exists(entry)) continue;
-    if (fs::is_regular_file(entry))
+    std::string& header{this->arena().s_header};
+    header.assign(bodyOffset, '\0');
+    if (pread(ifd, header.data(), header.size(), 0) != static_cast<ssize_t>(header.size()))
+      throw std::runtime_error{"Failed to read " + filename};
+    std::string& prefix{this->arena().s_prefix};
+    if (chunked) this->make_chunked_prefix(prefix);
+    else this->make_prefix(prefix);
+    header.replace(32, prefix.size(), prefix);
+    this->output_open(ofile, tempname, filesize, bodyOffset);
+    unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, g_ioBlocks * g_actualKlen)};
+    for (std::uint64_t offset{}; offset < bodysize;)
     {
-      this->encrypt(entry.string());
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(g_ioBlocks * g_actualKlen, bodysize - offset))};
+      if (this->input_read(ifd, fbuf, n, bodyOffset + offset) != n)
+        throw std::runtime_error{"File shrank while being rekeyed: " + filename};
+      this->apply_key(fbuf, n, offset, combinedKey);
+      this->output_write(ofile, fbuf, n);
+      offset += n;
     }
-    //
-    // If entry is a directory, recurse through it and encrypt all
-    // its files.
-    //
-    else if (fs::is_directory(entry))
-      for (auto dfile : fs::recursive_directory_iterator(entry))
-        if (fs::is_regular_file(dfile))
-          this->encrypt(fs::path{dfile}.string());
+    this->output_write(ofile, newHash.data(), newHash.size());
+    this->output_close(ofile, header);
+  }
+  catch (...)
+  {
+    close(ifd);
+    this->output_abort(ofile, tempname);
+    throw;
   }
+  close(ifd);
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+// Encrypt all entries in Krenq.
+void Krenq::encrypt_all()
+{
+  this->encrypt_entries(m_entries);
 }
 
 // Decrypt all entries in Krenq.
 void Krenq::decrypt_all(const std::string& keyname)
 {
-  for (auto e : m_entries)
+  this->decrypt_entries(m_entries, keyname);
+}
+
+//
+// Add keys to key ring. Directories are searched for key files, not
+// recursively. Keys are indexed by the keyhash files carry. A keyhash
+// only covers the encrypted key up to its first null byte, so two
+// different keys can share one, and files couldn't tell which key is
+// theirs. Such a key is refused rather than dropped.
+//
+void Krenq::load_key_ring(const std::vector<std::string>& keynames)
+{
+  auto add{[&](const std::string& keyname)
+  {
+    std::shared_ptr<const Krenq::KeyTile> key{this->extract_key(keyname)};
+    auto [iter, added]{m_keyRing.emplace(key->s_keyHash, key)};
+    if (!added and iter->second->s_key != key->s_key)
+      throw std::runtime_error{"Key " + keyname + " has the same keyhash as another key in key ring!"};
+  }};
+  for (auto& keyname : keynames)
   {
-    fs::path entry{e};
-    if (!fs::exists(entry)) continue;
-    if (fs::is_regular_file(entry))
+    if (!fs::is_directory(keyname))
     {
-      this->decrypt(entry.string(), keyname);
+      add(keyname);
+      continue;
+    }
+    for (auto& entry : fs::directory_iterator{keyname})
+    {
+      if (!entry.is_regular_file() or entry.path().extension() != ".krenq") continue;
+      add(entry.path().string());
     }
-    //
-    // If entry is a directory, recurse through it and encrypt all
-    // its files.
-    //
-    else if (fs::is_directory(entry))
-      for (auto dfile : fs::recursive_directory_iterator(entry))
-        if (fs::is_regular_file(dfile))
-          this->decrypt(fs::path{dfile}.string(), keyname);
   }
 }
 
+// Decrypt all entries in Krenq, every file with its key from key ring.
+void Krenq::decrypt_all_with_ring()
+{
+  if (m_keyRing.empty())
+    throw std::runtime_error{"Load keys using load_key_ring() before trying to decrypt with them!"};
+  this->decrypt_entries(m_entries, m_keyRing);
+}
+
 // Re-encrypt all entries in Krenq.
 void Krenq::re_encrypt_all()
 {
-  for (auto e : m_entries)
+  this->re_encrypt_entries(m_entries);
+}
+
+// Move all entries encrypted with the old key to the new key.
+void Krenq::rekey(const std::string& oldKeyname, const std::string& newKeyname)
+{
+  this->rekey_entries(m_entries, oldKeyname, newKeyname);
+}
+
+//
+// Return encryption state of all entries. Only headers and trailers
+// are read, by all workers in parallel.
+//
+std::vector<Krenq::FileStatus> Krenq::status_all()
+{
+  static const char digits[]{"0123456789abcdef"};
+  std::vector<Krenq::FileStatus> statuses{};
+  std::mutex mutex{};
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(m_entries)};
+  this->run_jobs(queues, [&](const Krenq::FileJob& file)
   {
-    fs::path entry{e};
-    if (!fs::exists(entry)) continue;
-    if (fs::is_regular_file(entry))
+    Krenq::EStatus estatus{this->krenq_status(file.s_path)};
+    Krenq::FileStatus status{file.s_path, Krenq::Format::plain, estatus.s_size, {}};
+    if (estatus.s_encrypted)
     {
-      if (!m_emap.contains(entry.string()))
-        continue;
-      this->re_encrypt(entry.string());
+      if (this->is_manifest(estatus)) status.s_format = Krenq::Format::deduplicated;
+      else if (this->is_chunked(estatus)) status.s_format = Krenq::Format::chunked;
+      else status.s_format = Krenq::Format::classic;
+      for (unsigned char c : estatus.s_keyHash)
+      {
+        status.s_keyHash += digits[c >> 4];
+        status.s_keyHash += digits[c & 0x0f];
+      }
     }
-    //
-    // If entry is a directory, recurse through it and encrypt all
-    // its files.
-    //
-    else if (fs::is_directory(entry))
-      for (auto dfile : fs::recursive_directory_iterator(entry))
-        if (fs::is_regular_file(dfile))
-        {
-          if (!m_emap.contains(fs::path{dfile}.string()))
-            continue;
-          this->re_encrypt(fs::path{dfile}.string());
-        }
+    std::lock_guard<std::mutex> lock{mutex};
+    statuses.emplace_back(std::move(status));
+  });
+  std::sort(statuses.begin(), statuses.end(), [](const auto& a, const auto& b){ return a.s_path < b.s_path; });
+  return statuses;
+}
+
+// Encrypt given entries. Directories are recursed through.
+void Krenq::encrypt_entries(const std::vector<std::string>& entries)
+{
+  if (!m_keyIsSaved)
+  {
+    throw std::runtime_error{"Save the key using save_key() before trying to encrypt anything!"};
   }
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(entries)};
+  this->run_jobs(queues, [this](const Krenq::FileJob& file)
+  {
+    this->encrypt(file);
+  });
 }
 
-// Add padding to file to make it multiple of 154 bytes.
-void Krenq::add_padding(const std::string& filename, size_t filesize)
+// Decrypt given entries. Directories are recursed through.
+void Krenq::decrypt_entries(const std::vector<std::string>& entries, const std::string& keyname)
 {
-  std::fstream afile{filename, std::ios::app | std::ios::binary};
-  size_t padn{static_cast<int>(std::ceil(filesize / static_cast<double>(g_actualKlen))) * g_actualKlen - filesize};
-  std::string padding{};
-  padding.reserve(padn);
-  for (size_t i{}; i < padn; ++i) padding += 0x1f;
-  afile << padding;
-  afile.close();
+  // Extract the key up front, workers only read it.
+  std::shared_ptr<const Krenq::KeyTile> key{this->extract_key(keyname)};
+  this->decrypt_entries(entries, Krenq::KeyRing{{key->s_keyHash, key}});
 }
 
-// Remove padding from file.
-void Krenq::remove_padding(const std::string& filename)
+// Decrypt given entries with whichever key of key ring they need.
+void Krenq::decrypt_entries(const std::vector<std::string>& entries, const Krenq::KeyRing& ring)
+{
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(entries)};
+  size_t nfiles{};
+  for (auto& queue : queues)
+    for (auto& job : queue.s_jobs) nfiles += job.size();
+  m_decrypted.clear();
+  m_decrypted.reserve(nfiles);
+  // Files decrypted before a failure are remembered all the same.
+  std::exception_ptr error{};
+  try
+  {
+    this->run_jobs(queues, [this, &ring](const Krenq::FileJob& file)
+    {
+      this->decrypt(file, ring);
+    });
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+  this->remember_keys();
+  if (error) std::rethrow_exception(error);
+}
+
+// Re-encrypt given entries which were decrypted in this runtime.
+void Krenq::re_encrypt_entries(const std::vector<std::string>& entries)
+{
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(entries)};
+  this->run_jobs(queues, [this](const Krenq::FileJob& file)
+  {
+    if (!this->decrypted_key(file.s_path)) return;
+    this->re_encrypt(file);
+  });
+}
+
+//
+// Move given entries from one key to another. Directories are
+// recursed through.
+//
+// Both keys are XOR keystreams over the same body offsets, so
+// XOR'ing a body with both keys at once turns it from the old key to
+// the new one without the plain data ever being formed, let alone
+// written. Every file is read and written exactly once.
+//
+void Krenq::rekey_entries(const std::vector<std::string>& entries, const std::string& oldKeyname, const std::string& newKeyname)
+{
+  std::shared_ptr<const Krenq::KeyTile> oldKey{this->extract_key(oldKeyname)};
+  std::shared_ptr<const Krenq::KeyTile> newKey{this->extract_key(newKeyname)};
+  if (oldKey->s_keyHash == newKey->s_keyHash) return;
+  std::string combined(g_actualKlen, '\0');
+  for (size_t i{}; i < g_actualKlen; ++i) combined[i] = oldKey->s_key[i] ^ newKey->s_key[i];
+  std::shared_ptr<const Krenq::KeyTile> combinedKey{this->expand_key(combined, {})};
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(entries)};
+  this->run_jobs(queues, [&](const Krenq::FileJob& file)
+  {
+    this->rekey_file(file, *oldKey, *newKey, *combinedKey);
+  });
+}
+
+//
+// XOR data found at given offset of encrypted body with the key. The
+// tile holds the key repeated, so whole runs of it line up with data
+// and are XOR'ed in a single plain loop.
+//
+void Krenq::apply_key(unsigned char* data, size_t n, std::uint64_t offset, const Krenq::KeyTile& key)
+{
+  const unsigned char* tile{key.s_tile.data() + offset % g_actualKlen};
+  // A multiple of key length, so every run starts at the same phase.
+  size_t span{key.s_tile.size() - g_actualKlen};
+  while (n > 0)
+  {
+    size_t len{std::min(n, span)};
+    for (size_t i{}; i < len; ++i) data[i] ^= tile[i];
+    data += len;
+    n -= len;
+  }
+}
+
+// Return size of plain data once padded to a multiple of 154 bytes.
+std::uint64_t Krenq::padded_size(std::uint64_t filesize)
+{
+  return filesize + (g_actualKlen - filesize % g_actualKlen) % g_actualKlen;
+}
+
+// Write padding after the last plain byte to make data multiple of
+// 154 bytes. Return the number of padding bytes.
+size_t Krenq::add_padding(unsigned char* tail, std::uint64_t filesize)
+{
+  size_t padn{static_cast<size_t>(this->padded_size(filesize) - filesize)};
+  std::memset(tail, 0x1f, padn);
+  return padn;
+}
+
+// Return the number of padding bytes at the end of decrypted last block.
+size_t Krenq::remove_padding(const unsigned char* block)
 {
-  Krenq::type_estatus estatus{};
-  this->krenq_status(filename, estatus);
-  size_t filesize{std::get<2>(estatus)};
-  std::fstream ifile{filename, std::ios::in | std::ios::binary};
-  ifile.seekg(filesize - g_actualKlen, std::ios::beg);
-  std::array<unsigned char, g_actualKlen> arr{};
-  ifile.read(reinterpret_cast<char*>(arr.data()), g_actualKlen);
   size_t padn{0};
-  for (auto iter{arr.rbegin()}; iter != arr.rend(); ++iter)
+  for (size_t i{g_actualKlen}; i > 0; --i)
   {
-    if (*iter != 0x1f) break;
-    if (*iter == 0x1f) ++padn;
+    if (block[i - 1] != 0x1f) break;
+    ++padn;
   }
-  size_t new_filesize{filesize - padn};
-  ifile.close();
-  fs::resize_file(fs::path{filename}, new_filesize);
+  return padn;
 }
 
-// Extract key from key file.
-void Krenq::extract_key(const std::string& keyname)
+//
+// Extract key from key file. Keys are cached by hash of their key
+// file, so the same key under another name is extracted once and a
+// rewritten key file is never mistaken for the old one.
+//
+std::shared_ptr<const Krenq::KeyTile> Krenq::extract_key(const std::string& keyname)
 {
-  if (g_kmap.contains(keyname)) return;
   std::fstream ifile{keyname, std::ios::in | std::ios::binary};
   ifile.seekg(0, std::ios::end);
   if (ifile.tellg() != g_encryptedKlen)
     throw std::runtime_error{"Invalid key!"};
   ifile.seekg(0, std::ios::beg);
-  Key* providedKey{new Key{}};
+  std::string ekstr(g_encryptedKlen, '\0');
+  ifile.read(ekstr.data(), g_encryptedKlen);
+  ifile.close();
+  std::array<std::uint8_t, 32> id{};
+  calc_sha_256(id.data(), ekstr.data(), ekstr.size());
+  std::string keyId{id.begin(), id.end()};
+  if (auto key{this->find_key(keyId)}) return key;
+
+  Key providedKey{};
+  std::memcpy(&providedKey, ekstr.data(), sizeof(Key));
   std::string extractedKey{};
   extractedKey.reserve(g_actualKlen);
-  ifile.read(reinterpret_cast<char*>(providedKey), sizeof(Key));
-
-  extractedKey += std::to_string(providedKey->s_kid);
-  extractedKey += providedKey->s_ksport1;
-  extractedKey += std::to_string(providedKey->s_rt1);
-  extractedKey += providedKey->s_ksport2;
-  extractedKey += std::to_string(providedKey->s_rt2);
-  extractedKey += providedKey->s_ksport3;
-  extractedKey += std::to_string(providedKey->s_rt3);
-  extractedKey += providedKey->s_ksport4;
-  extractedKey += std::to_string(providedKey->s_rt4);
-
-  size_t diff{g_actualKlen - extractedKey.length()};
-  extractedKey += extractedKey.substr(0, diff);
-
-  g_kmap[keyname] = extractedKey;
-  ifile.close();
-  std::fstream ikey{keyname, std::ios::in | std::ios::binary};
-  std::string ekstr{};
-  std::array<unsigned char, 32> arr{};
-  ikey.read(reinterpret_cast<char*>(arr.data()), 32);
-  for (auto c : arr) ekstr += c;
-  m_kenmap[keyname] = ekstr;
-  ikey.close();
-  delete providedKey;
-}
+  extractedKey += std::to_string(providedKey.s_kid);
+  extractedKey += providedKey.s_ksport1;
+  extractedKey += std::to_string(providedKey.s_rt1);
+  extractedKey += providedKey.s_ksport2;
+  extractedKey += std::to_string(providedKey.s_rt2);
+  extractedKey += providedKey.s_ksport3;
+  extractedKey += std::to_string(providedKey.s_rt3);
+  extractedKey += providedKey.s_ksport4;
+  extractedKey += std::to_string(providedKey.s_rt4);
 
+  pad_key(extractedKey);
 
+  // Files name their key by the hash of its first 32 bytes.
+  std::shared_ptr<const Krenq::KeyTile> key{this->expand_key(extractedKey, ekstr.substr(0, 32))};
+  this->cache_key(keyId, key);
+  return key;
+}
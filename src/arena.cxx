@@ -0,0 +1,122 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of a huge page, the x86-64 and arm64 default.
+static const size_t g_hugePage{2 * 1024 * 1024};
+// Room for a path and the suffix of its temporary file.
+static const size_t g_pathRoom{PATH_MAX + 64};
+
+//
+// Back worker buffers with huge pages. Buffers are rounded up to a
+// whole number of huge pages and taken from the reserved pool if
+// there is one, or else marked for transparent huge pages. Buffers
+// already made keep their pages.
+//
+void Krenq::set_huge_pages(bool huge)
+{
+  m_hugePages = huge;
+}
+
+// Give strings holding paths room for any path up front.
+Krenq::Arena::Arena()
+{
+  s_tempname.reserve(g_pathRoom);
+  s_chunkPath.reserve(g_pathRoom);
+  s_chunkTemp.reserve(g_pathRoom);
+}
+
+// Unmap buffers once the arena is done with.
+Krenq::Arena::~Arena()
+{
+  for (size_t slot{}; slot < s_buffers.size(); ++slot)
+    if (s_buffers[slot]) munmap(s_buffers[slot], s_sizes[slot]);
+}
+
+// Arena of the pool held by the calling thread, if it is a worker.
+Krenq::Arena*& Krenq::held_arena()
+{
+  static thread_local Krenq::Arena* held{nullptr};
+  return held;
+}
+
+//
+// Arena of the calling thread. Workers hold one of the pool, other
+// threads, such as those reading files, have one of their own.
+//
+Krenq::Arena& Krenq::arena()
+{
+  if (Krenq::Arena* held{Krenq::held_arena()}) return *held;
+  static thread_local Krenq::Arena arena{};
+  return arena;
+}
+
+//
+// Hold an arena of the pool for the calling worker, making one if
+// all are taken. Workers of a run after the first find theirs warm.
+//
+Krenq::Arena* Krenq::acquire_arena()
+{
+  Krenq::Arena*& held{Krenq::held_arena()};
+  std::lock_guard<std::mutex> lock{m_arenaMutex};
+  if (m_freeArenas.empty())
+  {
+    m_arenas.emplace_back(std::make_unique<Krenq::Arena>());
+    m_freeArenas.reserve(m_arenas.size());
+    held = m_arenas.back().get();
+  }
+  else
+  {
+    held = m_freeArenas.back();
+    m_freeArenas.pop_back();
+  }
+  return held;
+}
+
+// Give arena of the calling worker back to the pool.
+void Krenq::release_arena(Krenq::Arena* arena)
+{
+  Krenq::held_arena() = nullptr;
+  std::lock_guard<std::mutex> lock{m_arenaMutex};
+  m_freeArenas.emplace_back(arena);
+}
+
+//
+// Return buffer of slot in arena of the calling thread, at least
+// bytes long. Its contents are left as they were unless it had to
+// grow, in which case they are undefined. Buffers are kept out of
+// core dumps, as they hold plain data.
+//
+unsigned char* Krenq::arena_buffer(Krenq::ArenaSlot slot, size_t bytes)
+{
+  Krenq::Arena& arena{this->arena()};
+  size_t i{static_cast<size_t>(slot)};
+  if (arena.s_sizes[i] >= bytes) return arena.s_buffers[i];
+  if (arena.s_buffers[i]) munmap(arena.s_buffers[i], arena.s_sizes[i]);
+  arena.s_buffers[i] = nullptr;
+  arena.s_sizes[i] = 0;
+  size_t unit{m_hugePages ? g_hugePage : static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+  size_t size{(bytes + unit - 1) / unit * unit};
+  void* p{MAP_FAILED};
+  if (m_hugePages) p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED)
+  {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc{};
+    if (m_hugePages) madvise(p, size, MADV_HUGEPAGE);
+  }
+  madvise(p, size, MADV_DONTDUMP);
+  arena.s_buffers[i] = static_cast<unsigned char*>(p);
+  arena.s_sizes[i] = size;
+  return arena.s_buffers[i];
+}
@@ -0,0 +1,615 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+//
+// Chunked format.
+//
+// Header: Merkle root, pattern, chunked marker, pattern.
+// Chunk header: magic, version, flags, chunk size, plain size, body
+// size and table size, little endian.
+// Table: Merkle tree over plain chunks, level by level from leaves
+// up to the root. Compressed files follow it with the stored length
+// of every chunk, 4 bytes each. Sparse files end it with an extent
+// map: file size, number of data extents, then offset and length of
+// every one of them, 8 bytes each.
+// Body: chunks, compressed or as they are, XOR'ed with the key by
+// body offset. A chunk stored at its plain length is not compressed.
+// Trailer: encrypted key hash.
+//
+// Chunks of sparse files are cut from their data extents alone, and
+// plain size is their total size. Their root in header is sealed
+// with the extent map, so the map can't be changed unnoticed.
+//
+
+// Size of header: Merkle root, pattern, marker, pattern.
+static const size_t g_headerSize{32 + 12 + 1 + 12};
+// Size of trailer: encrypted key hash.
+static const size_t g_keyHashSize{32};
+// Size of chunk header.
+static const size_t g_chunkHeaderSize{36};
+// Size of a hash in Merkle tree.
+static const size_t g_nodeSize{32};
+// Magic of chunk header and the only version there is.
+static const char g_chunkMagic[4]{'K', 'R', 'Q', 'C'};
+static const unsigned char g_chunkVersion{1};
+// Smallest and largest chunk size.
+static const size_t g_minChunkSize{4 * 1024};
+static const size_t g_maxChunkSize{64 * 1024 * 1024};
+// Chunk size used by compression when none is set.
+static const size_t g_defaultChunkSize{1024 * 1024};
+// Flag of compressed files in chunk header.
+static const std::uint8_t g_compressedFlag{0x01};
+// Size of a stored chunk length.
+static const size_t g_lengthSize{4};
+// Flag of sparse files in chunk header.
+static const std::uint8_t g_sparseFlag{0x02};
+// Size of extent map header and of an extent in it.
+static const size_t g_mapHeaderSize{16};
+static const size_t g_extentEntrySize{16};
+
+// Write n bytes of value in little endian.
+static void put_le(std::string& out, std::uint64_t value, size_t n)
+{
+  for (size_t i{}; i < n; ++i) out += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+// Read n bytes of little endian value.
+static std::uint64_t get_le(const unsigned char* in, size_t n)
+{
+  std::uint64_t value{};
+  for (size_t i{n}; i > 0; --i) value = (value << 8) | in[i - 1];
+  return value;
+}
+
+// Hash of a Merkle node made of two children, into out. Out may be
+// either child.
+static void node_hash(const char* left, const char* right, char* out)
+{
+  struct Sha_256 sha_256;
+  std::array<std::uint8_t, 32> hash{};
+  sha_256_init(&sha_256, hash.data());
+  const unsigned char tag{0x01};
+  sha_256_write(&sha_256, &tag, 1);
+  sha_256_write(&sha_256, left, g_nodeSize);
+  sha_256_write(&sha_256, right, g_nodeSize);
+  sha_256_close(&sha_256);
+  std::memcpy(out, hash.data(), g_nodeSize);
+}
+
+//
+// Write files in chunked format, with a hash per chunk of given size.
+// Zero writes classic format. Chunked files can be verified a chunk
+// at a time, in parallel, and read in ranges.
+//
+void Krenq::set_chunk_size(size_t chunkSize)
+{
+  if (chunkSize != 0 and (chunkSize < g_minChunkSize or chunkSize > g_maxChunkSize))
+    throw std::runtime_error{"Chunk size must be between 4 KiB and 64 MiB!"};
+  m_chunkSize = chunkSize;
+}
+
+//
+// Compress files before encrypting them. Compressed files are always
+// written in chunked format, with chunks of 1 MiB unless set. Files
+// whose first chunk doesn't shrink by an eighth are stored as they
+// are, and so is every chunk that doesn't shrink at all.
+//
+void Krenq::set_compression(bool compression)
+{
+  m_compression = compression;
+}
+
+// Serialize chunk header at the end of out.
+void Krenq::pack_chunk_header(const Krenq::ChunkHeader& chunkHeader, std::string& out)
+{
+  out.append(g_chunkMagic, sizeof(g_chunkMagic));
+  put_le(out, g_chunkVersion, 1);
+  put_le(out, chunkHeader.s_flags, 1);
+  put_le(out, 0, 2);
+  put_le(out, chunkHeader.s_chunkSize, 4);
+  put_le(out, chunkHeader.s_plainSize, 8);
+  put_le(out, chunkHeader.s_bodySize, 8);
+  put_le(out, chunkHeader.s_tableSize, 8);
+}
+
+//
+// Read chunk header of a chunked file. Return false if it is not a
+// chunk header or if its sizes don't add up to the file size.
+//
+bool Krenq::read_chunk_header(int fd, std::uint64_t filesize, Krenq::ChunkHeader& chunkHeader)
+{
+  std::array<unsigned char, g_chunkHeaderSize> raw{};
+  if (pread(fd, raw.data(), raw.size(), g_headerSize) != static_cast<ssize_t>(raw.size())) return false;
+  if (std::memcmp(raw.data(), g_chunkMagic, sizeof(g_chunkMagic)) != 0 or raw[4] != g_chunkVersion) return false;
+  chunkHeader.s_flags = raw[5];
+  chunkHeader.s_chunkSize = static_cast<std::uint32_t>(get_le(raw.data() + 8, 4));
+  chunkHeader.s_plainSize = get_le(raw.data() + 12, 8);
+  chunkHeader.s_bodySize = get_le(raw.data() + 20, 8);
+  chunkHeader.s_tableSize = get_le(raw.data() + 28, 8);
+  chunkHeader.s_bodyOffset = g_headerSize + g_chunkHeaderSize + chunkHeader.s_tableSize;
+  if (chunkHeader.s_chunkSize < g_minChunkSize or chunkHeader.s_chunkSize > g_maxChunkSize) return false;
+  if (chunkHeader.s_plainSize == 0) return false;
+  if ((chunkHeader.s_flags & ~(g_compressedFlag | g_sparseFlag)) != 0) return false;
+  bool compressed{(chunkHeader.s_flags & g_compressedFlag) != 0};
+  bool sparse{(chunkHeader.s_flags & g_sparseFlag) != 0};
+  std::uint64_t chunks{(chunkHeader.s_plainSize - 1) / chunkHeader.s_chunkSize + 1};
+  if (chunkHeader.s_tableSize < this->merkle_nodes(chunks) * g_nodeSize + (compressed ? chunks * g_lengthSize : 0) + (sparse ? g_mapHeaderSize : 0))
+    return false;
+  if (!compressed and chunkHeader.s_bodySize != chunkHeader.s_plainSize) return false;
+  return chunkHeader.s_bodyOffset < filesize and filesize - chunkHeader.s_bodyOffset >= g_keyHashSize and
+    chunkHeader.s_bodySize == filesize - chunkHeader.s_bodyOffset - g_keyHashSize;
+}
+
+//
+// Find where every chunk of a chunked file starts in body, with the
+// end of body last. Return false if stored lengths don't add up.
+//
+bool Krenq::read_chunk_offsets(int fd, const Krenq::ChunkHeader& chunkHeader, std::vector<std::uint64_t>& offsets)
+{
+  size_t chunks{static_cast<size_t>((chunkHeader.s_plainSize - 1) / chunkHeader.s_chunkSize + 1)};
+  offsets.resize(chunks + 1);
+  if ((chunkHeader.s_flags & g_compressedFlag) == 0)
+  {
+    for (size_t chunk{}; chunk < chunks; ++chunk) offsets[chunk] = static_cast<std::uint64_t>(chunk) * chunkHeader.s_chunkSize;
+    offsets[chunks] = chunkHeader.s_plainSize;
+    return true;
+  }
+  std::string& lengths{this->arena().s_lengths};
+  lengths.resize(chunks * g_lengthSize);
+  auto* raw{reinterpret_cast<unsigned char*>(lengths.data())};
+  std::uint64_t tableOffset{g_headerSize + g_chunkHeaderSize + this->merkle_nodes(chunks) * g_nodeSize};
+  if (this->input_read(fd, raw, lengths.size(), tableOffset) != lengths.size()) return false;
+  offsets[0] = 0;
+  for (size_t chunk{}; chunk < chunks; ++chunk)
+  {
+    std::uint64_t length{get_le(raw + chunk * g_lengthSize, g_lengthSize)};
+    std::uint64_t plain{std::min<std::uint64_t>(chunkHeader.s_chunkSize, chunkHeader.s_plainSize - static_cast<std::uint64_t>(chunk) * chunkHeader.s_chunkSize)};
+    if (length == 0 or length > plain) return false;
+    offsets[chunk + 1] = offsets[chunk] + length;
+  }
+  return offsets[chunks] == chunkHeader.s_bodySize;
+}
+
+// Serialize extent map of a sparse file into out.
+void Krenq::pack_extent_map(std::uint64_t filesize, const std::vector<Krenq::Extent>& extents, std::string& out)
+{
+  out.clear();
+  out.reserve(g_mapHeaderSize + extents.size() * g_extentEntrySize);
+  put_le(out, filesize, 8);
+  put_le(out, extents.size(), 8);
+  for (auto& extent : extents)
+  {
+    put_le(out, extent.s_offset, 8);
+    put_le(out, extent.s_length, 8);
+  }
+}
+
+//
+// Read extent map of a chunked file, raw map into map. Files which
+// aren't sparse are a single extent with an empty map. Return false
+// if extents overlap, go past the end or don't add up to plain size.
+//
+bool Krenq::read_extent_map(int fd, const Krenq::ChunkHeader& chunkHeader, std::vector<Krenq::Extent>& extents, std::uint64_t& filesize, std::string& map)
+{
+  map.clear();
+  if ((chunkHeader.s_flags & g_sparseFlag) == 0)
+  {
+    extents = {Krenq::Extent{0, chunkHeader.s_plainSize, 0}};
+    filesize = chunkHeader.s_plainSize;
+    return true;
+  }
+  size_t chunks{static_cast<size_t>((chunkHeader.s_plainSize - 1) / chunkHeader.s_chunkSize + 1)};
+  std::uint64_t mapOffset{g_headerSize + g_chunkHeaderSize + this->merkle_nodes(chunks) * g_nodeSize};
+  if ((chunkHeader.s_flags & g_compressedFlag) != 0) mapOffset += chunks * g_lengthSize;
+  std::uint64_t mapSize{chunkHeader.s_bodyOffset - mapOffset};
+  if (mapSize < g_mapHeaderSize or (mapSize - g_mapHeaderSize) % g_extentEntrySize != 0) return false;
+  map.resize(mapSize);
+  auto* raw{reinterpret_cast<unsigned char*>(map.data())};
+  if (this->input_read(fd, raw, map.size(), mapOffset) != map.size()) return false;
+  filesize = get_le(raw, 8);
+  std::uint64_t count{get_le(raw + 8, 8)};
+  if (count == 0 or count != (mapSize - g_mapHeaderSize) / g_extentEntrySize) return false;
+  extents.resize(count);
+  std::uint64_t end{0};
+  std::uint64_t packed{0};
+  for (size_t i{}; i < count; ++i)
+  {
+    const unsigned char* e{raw + g_mapHeaderSize + i * g_extentEntrySize};
+    extents[i] = Krenq::Extent{get_le(e, 8), get_le(e + 8, 8), packed};
+    if (extents[i].s_offset < end or extents[i].s_length == 0 or extents[i].s_length > filesize - extents[i].s_offset) return false;
+    end = extents[i].s_offset + extents[i].s_length;
+    packed += extents[i].s_length;
+  }
+  return packed == chunkHeader.s_plainSize;
+}
+
+// Root in header, into out: Merkle root, sealed with extent map if
+// there is one.
+void Krenq::seal_root(const char* root, const std::string& map, char* out)
+{
+  if (map.empty())
+  {
+    std::memmove(out, root, g_nodeSize);
+    return;
+  }
+  struct Sha_256 sha_256;
+  std::array<std::uint8_t, 32> hash{};
+  sha_256_init(&sha_256, hash.data());
+  const unsigned char tag{0x02};
+  sha_256_write(&sha_256, &tag, 1);
+  sha_256_write(&sha_256, root, g_nodeSize);
+  sha_256_write(&sha_256, map.data(), map.size());
+  sha_256_close(&sha_256);
+  std::memcpy(out, hash.data(), g_nodeSize);
+}
+
+//
+// Read a single chunk of a chunked file into buffer, decrypted and
+// decompressed, and return its plain size. Buffer holds twice the
+// chunk size. Throws if the chunk can't be read or doesn't decompress
+// to its plain size.
+//
+size_t Krenq::read_chunk(int fd, const Krenq::ChunkHeader& chunkHeader, const std::vector<std::uint64_t>& offsets, const Krenq::KeyTile& key, size_t chunk, unsigned char* fbuf)
+{
+  std::uint64_t start{static_cast<std::uint64_t>(chunk) * chunkHeader.s_chunkSize};
+  size_t n{static_cast<size_t>(std::min<std::uint64_t>(chunkHeader.s_chunkSize, chunkHeader.s_plainSize - start))};
+  size_t length{static_cast<size_t>(offsets[chunk + 1] - offsets[chunk])};
+  // Compressed chunks are read past the plain one and inflated in front.
+  unsigned char* payload{length < n ? fbuf + n : fbuf};
+  if (this->input_read(fd, payload, length, chunkHeader.s_bodyOffset + offsets[chunk]) != length)
+    throw std::runtime_error{"Chunk " + std::to_string(chunk) + " is cut short!"};
+  this->apply_key(payload, length, offsets[chunk], key);
+  if (length < n and this->decompress_chunk(payload, length, fbuf, n) != n)
+    throw std::runtime_error{"Chunk " + std::to_string(chunk) + " doesn't decompress!"};
+  return n;
+}
+
+// Number of nodes in Merkle tree over given number of leaves.
+size_t Krenq::merkle_nodes(size_t leaves)
+{
+  size_t nodes{leaves};
+  for (size_t level{leaves}; level > 1; level = (level + 1) / 2) nodes += (level + 1) / 2;
+  return nodes;
+}
+
+// Hash of a Merkle leaf made of a plain chunk, into out.
+void Krenq::merkle_leaf(const unsigned char* data, size_t n, char* out)
+{
+  struct Sha_256 sha_256;
+  std::array<std::uint8_t, 32> hash{};
+  sha_256_init(&sha_256, hash.data());
+  const unsigned char tag{0x00};
+  sha_256_write(&sha_256, &tag, 1);
+  sha_256_write(&sha_256, data, n);
+  sha_256_close(&sha_256);
+  std::memcpy(out, hash.data(), g_nodeSize);
+}
+
+//
+// Build Merkle tree over given number of leaf hashes at the start of
+// tree, which has room for all of its nodes. Levels follow each other
+// from leaves up, the root comes last. A node left without a sibling
+// is carried to the level above as it is.
+//
+void Krenq::merkle_tree(char* tree, size_t leaves)
+{
+  size_t begin{0};
+  size_t end{leaves * g_nodeSize};
+  for (size_t level{leaves}; level > 1; level = (level + 1) / 2)
+  {
+    for (size_t i{}; i < level; i += 2)
+    {
+      const char* left{tree + begin + i * g_nodeSize};
+      if (i + 1 < level) node_hash(left, left + g_nodeSize, tree + end);
+      else std::memcpy(tree + end, left, g_nodeSize);
+      end += g_nodeSize;
+    }
+    begin += level * g_nodeSize;
+  }
+}
+
+//
+// Check the hash of a single leaf against the Merkle root, reading
+// only the siblings on its way up from the tree stored at offset.
+//
+bool Krenq::merkle_check(int fd, std::uint64_t treeOffset, size_t leaves, size_t index, const char* leaf, const char* root)
+{
+  std::array<char, g_nodeSize> hash{};
+  std::array<char, g_nodeSize> other{};
+  std::memcpy(hash.data(), leaf, g_nodeSize);
+  std::uint64_t begin{treeOffset};
+  for (size_t level{leaves}; level > 1; level = (level + 1) / 2)
+  {
+    size_t sibling{index ^ 1};
+    if (sibling < level)
+    {
+      if (pread(fd, other.data(), g_nodeSize, static_cast<off_t>(begin + sibling * g_nodeSize)) != static_cast<ssize_t>(g_nodeSize))
+        return false;
+      if (index % 2 == 0) node_hash(hash.data(), other.data(), hash.data());
+      else node_hash(other.data(), hash.data(), hash.data());
+    }
+    begin += level * g_nodeSize;
+    index /= 2;
+  }
+  return std::memcmp(hash.data(), root, g_nodeSize) == 0;
+}
+
+//
+// Write chunked form of a plain file and replace the file with it.
+//
+// Chunk count, and so the size of the tables, is known up front, so
+// the body goes to its final place right away. Chunks are hashed as
+// they are read and the tables are written along with the header
+// last. With compression on, the first chunk is compressed before
+// anything is written to decide whether the file is worth it. Only
+// data extents of sparse files are read. Direct I/O isn't used for
+// chunked files. Buffers, tables and header come from the arena of
+// this worker.
+//
+bool Krenq::write_encrypted_chunked(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& prefix, const std::string& kenhash, const std::string& tempname)
+{
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Krenq::Arena& arena{this->arena()};
+  std::vector<Krenq::Extent>& extents{arena.s_extents};
+  this->find_extents(ifd, filesize, extents);
+  std::string& map{arena.s_map};
+  map.clear();
+  std::uint64_t plainSize{filesize};
+  // A file of nothing but holes keeps its last byte, a zero, as data.
+  if (extents.empty()) extents = {Krenq::Extent{filesize - 1, 1, 0}};
+  if (extents.size() > 1 or extents[0].s_length != filesize)
+  {
+    this->pack_extent_map(filesize, extents, map);
+    plainSize = extents.back().s_packed + extents.back().s_length;
+  }
+  size_t chunkSize{m_chunkSize > 0 ? m_chunkSize : g_defaultChunkSize};
+  size_t chunks{static_cast<size_t>((plainSize - 1) / chunkSize + 1)};
+  Krenq::ChunkHeader chunkHeader{};
+  chunkHeader.s_chunkSize = static_cast<std::uint32_t>(chunkSize);
+  chunkHeader.s_plainSize = plainSize;
+  Krenq::OutputFile ofile{};
+  try
+  {
+    unsigned char* ibuf{this->arena_buffer(Krenq::ArenaSlot::input, chunkSize)};
+    unsigned char* cbuf{m_compression ? this->arena_buffer(Krenq::ArenaSlot::compressed, chunkSize) : nullptr};
+    size_t n{static_cast<size_t>(std::min<std::uint64_t>(chunkSize, plainSize))};
+    if (this->read_extents(ifd, extents, ibuf, n, 0) != n)
+      throw std::runtime_error{"File shrank while being encrypted: " + filename};
+    // Stored chunks must come out shorter than plain ones.
+    size_t packed{m_compression ? this->compress_chunk(ibuf, n, cbuf, n - std::max<size_t>(1, n / 8)) : 0};
+    bool compressed{packed > 0};
+    chunkHeader.s_flags = (compressed ? g_compressedFlag : 0) | (map.empty() ? 0 : g_sparseFlag);
+    chunkHeader.s_tableSize = this->merkle_nodes(chunks) * g_nodeSize + (compressed ? chunks * g_lengthSize : 0) + map.size();
+    std::uint64_t bodyOffset{g_headerSize + g_chunkHeaderSize + chunkHeader.s_tableSize};
+    // Size of compressed files isn't known until they are written.
+    this->output_open(ofile, tempname, compressed ? 0 : bodyOffset + plainSize + g_keyHashSize, bodyOffset);
+    // Leaves go in front of the tree, inner nodes follow once all are in.
+    std::string& tree{arena.s_tree};
+    tree.assign(this->merkle_nodes(chunks) * g_nodeSize, '\0');
+    std::string& lengths{arena.s_lengths};
+    lengths.clear();
+    std::uint64_t bodysize{0};
+    for (std::uint64_t offset{};;)
+    {
+      if (compressed and offset > 0) packed = this->compress_chunk(ibuf, n, cbuf, n - 1);
+      this->merkle_leaf(ibuf, n, tree.data() + offset / chunkSize * g_nodeSize);
+      unsigned char* payload{packed > 0 ? cbuf : ibuf};
+      size_t length{packed > 0 ? packed : n};
+      if (compressed) put_le(lengths, length, g_lengthSize);
+      this->apply_key(payload, length, bodysize, key);
+      this->output_write(ofile, payload, length);
+      bodysize += length;
+      offset += n;
+      if (offset == plainSize) break;
+      n = static_cast<size_t>(std::min<std::uint64_t>(chunkSize, plainSize - offset));
+      if (this->read_extents(ifd, extents, ibuf, n, offset) != n)
+        throw std::runtime_error{"File shrank while being encrypted: " + filename};
+    }
+    chunkHeader.s_bodySize = bodysize;
+    this->output_write(ofile, kenhash.data(), kenhash.size());
+    this->merkle_tree(tree.data(), chunks);
+    std::string& header{arena.s_header};
+    header.assign(g_nodeSize, '\0');
+    this->seal_root(tree.data() + tree.size() - g_nodeSize, map, header.data());
+    header += prefix;
+    this->pack_chunk_header(chunkHeader, header);
+    header += tree;
+    header += lengths;
+    header += map;
+    this->output_close(ofile, header);
+  }
+  catch (...)
+  {
+    close(ifd);
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  close(ifd);
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+//
+// Write decrypted form of a chunked file and replace the file with it.
+// Data extents of sparse files are written back where they were, and
+// the holes between them are never written.
+//
+bool Krenq::write_decrypted_chunked(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& tempname)
+{
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  Krenq::ChunkHeader chunkHeader{};
+  std::vector<std::uint64_t>& offsets{this->arena().s_offsets};
+  std::vector<Krenq::Extent>& extents{this->arena().s_extents};
+  std::uint64_t plainFilesize{};
+  std::string& map{this->arena().s_map};
+  if (!this->read_chunk_header(ifd, filesize, chunkHeader) or !this->read_chunk_offsets(ifd, chunkHeader, offsets) or
+    !this->read_extent_map(ifd, chunkHeader, extents, plainFilesize, map))
+  {
+    close(ifd);
+    return false;
+  }
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Krenq::OutputFile ofile{};
+  try
+  {
+    // Preallocating would fill in the holes.
+    this->output_open(ofile, tempname, map.empty() ? plainFilesize : 0, 0);
+    if (!map.empty() and ftruncate(ofile.s_fd, static_cast<off_t>(plainFilesize)) != 0)
+      throw std::runtime_error{"Failed to size " + tempname};
+    unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, 2 * static_cast<size_t>(chunkHeader.s_chunkSize))};
+    for (size_t chunk{}; chunk + 1 < offsets.size(); ++chunk)
+    {
+      size_t n{this->read_chunk(ifd, chunkHeader, offsets, key, chunk, fbuf)};
+      this->write_extents(ofile, extents, fbuf, n, static_cast<std::uint64_t>(chunk) * chunkHeader.s_chunkSize);
+    }
+    this->output_close(ofile, {});
+  }
+  catch (...)
+  {
+    close(ifd);
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  close(ifd);
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+//
+// Check chunks first to last of a chunked file against the leaves
+// of its tree. Chunks are decrypted into a scratch buffer only.
+// Throws if a chunk can't be read or decompressed.
+//
+bool Krenq::verify_chunks(int fd, const Krenq::ChunkHeader& chunkHeader, const std::vector<std::uint64_t>& offsets, const std::string& leaves, const Krenq::KeyTile& key, size_t first, size_t last)
+{
+  unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, 2 * static_cast<size_t>(chunkHeader.s_chunkSize))};
+  std::array<char, g_nodeSize> leaf{};
+  for (size_t chunk{first}; chunk < last; ++chunk)
+  {
+    size_t n{this->read_chunk(fd, chunkHeader, offsets, key, chunk, fbuf)};
+    this->merkle_leaf(fbuf, n, leaf.data());
+    if (leaves.compare(chunk * g_nodeSize, g_nodeSize, leaf.data(), g_nodeSize) != 0) return false;
+  }
+  return true;
+}
+
+//
+// Read length bytes of plain data at offset of a chunked file. Only
+// the chunks covering the range are read, each checked against the
+// Merkle root through its path up the tree. Throws if any of them
+// doesn't match. Holes of sparse files read as zeros. Reading past
+// the end returns less.
+//
+std::string Krenq::read_range(const std::string& filename, const std::string& keyname, std::uint64_t offset, size_t length)
+{
+  std::shared_ptr<const Krenq::KeyTile> key{this->extract_key(keyname)};
+  Krenq::EStatus estatus{this->krenq_status(filename)};
+  if (!estatus.s_encrypted or estatus.key_hash() != key->s_keyHash)
+    throw std::runtime_error{filename + " is not encrypted with " + keyname + "!"};
+  if (!this->is_chunked(estatus))
+    throw std::runtime_error{filename + " has no chunk hashes!"};
+  std::string out{};
+  this->read_chunked(filename, estatus, *key, offset, length, [&](std::uint64_t size)
+  {
+    out.assign(size, '\0');
+    return reinterpret_cast<unsigned char*>(out.data());
+  });
+  return out;
+}
+
+//
+// Read plain data of a chunked file as read_range() does, into memory
+// asked from output once its size is known. Nothing is asked when
+// the range is past the end. Chunks are decrypted into the input
+// buffer of the arena, which is wiped when done, failed or not.
+//
+void Krenq::read_chunked(const std::string& filename, const Krenq::EStatus& estatus, const Krenq::KeyTile& key, std::uint64_t offset, std::uint64_t length, const std::function<unsigned char*(std::uint64_t)>& output)
+{
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) throw std::runtime_error{"Failed to read " + filename};
+  unsigned char* fbuf{nullptr};
+  size_t fbufSize{0};
+  try
+  {
+    Krenq::ChunkHeader chunkHeader{};
+    std::vector<std::uint64_t> offsets{};
+    std::vector<Krenq::Extent> extents{};
+    std::uint64_t filesize{};
+    std::string map{};
+    std::array<char, g_nodeSize> sealed{};
+    std::array<char, g_nodeSize> root{};
+    std::array<char, g_nodeSize> expected{};
+    if (!this->read_chunk_header(ifd, estatus.s_size, chunkHeader) or
+      !this->read_chunk_offsets(ifd, chunkHeader, offsets) or
+      !this->read_extent_map(ifd, chunkHeader, extents, filesize, map) or
+      pread(ifd, sealed.data(), g_nodeSize, 0) != static_cast<ssize_t>(g_nodeSize))
+      throw std::runtime_error{"Broken chunk header in " + filename + "!"};
+    size_t leaves{offsets.size() - 1};
+    std::uint64_t treeOffset{g_headerSize + g_chunkHeaderSize};
+    std::uint64_t rootOffset{treeOffset + (this->merkle_nodes(leaves) - 1) * g_nodeSize};
+    if (pread(ifd, root.data(), g_nodeSize, static_cast<off_t>(rootOffset)) != static_cast<ssize_t>(g_nodeSize))
+      throw std::runtime_error{"Broken chunk header in " + filename + "!"};
+    this->seal_root(root.data(), map, expected.data());
+    if (expected != sealed)
+      throw std::runtime_error{"Broken chunk header in " + filename + "!"};
+    std::uint64_t end{filesize - std::min(filesize, offset) < length ? filesize : offset + length};
+    if (offset >= end)
+    {
+      close(ifd);
+      return;
+    }
+    unsigned char* out{output(end - offset)};
+    fbufSize = 2 * static_cast<size_t>(chunkHeader.s_chunkSize);
+    fbuf = this->arena_buffer(Krenq::ArenaSlot::input, fbufSize);
+    std::array<char, g_nodeSize> leaf{};
+    size_t loaded{leaves};
+    size_t n{0};
+    for (auto& extent : extents)
+    {
+      if (extent.s_offset + extent.s_length <= offset) continue;
+      if (extent.s_offset >= end) break;
+      std::uint64_t from{std::max(offset, extent.s_offset)};
+      std::uint64_t first{extent.s_packed + (from - extent.s_offset)};
+      std::uint64_t last{first + (std::min(end, extent.s_offset + extent.s_length) - from)};
+      for (size_t chunk{static_cast<size_t>(first / chunkHeader.s_chunkSize)}; static_cast<std::uint64_t>(chunk) * chunkHeader.s_chunkSize < last; ++chunk)
+      {
+        if (chunk != loaded)
+        {
+          n = this->read_chunk(ifd, chunkHeader, offsets, key, chunk, fbuf);
+          this->merkle_leaf(fbuf, n, leaf.data());
+          if (!this->merkle_check(ifd, treeOffset, leaves, chunk, leaf.data(), root.data()))
+            throw std::runtime_error{"Chunk " + std::to_string(chunk) + " of " + filename + " failed verification!"};
+          loaded = chunk;
+        }
+        std::uint64_t start{static_cast<std::uint64_t>(chunk) * chunkHeader.s_chunkSize};
+        std::uint64_t a{std::max(start, first)};
+        std::uint64_t b{std::min<std::uint64_t>(start + n, last)};
+        std::memcpy(out + (from - offset) + (a - first), fbuf + (a - start), b - a);
+      }
+    }
+  }
+  catch (...)
+  {
+    if (fbuf) explicit_bzero(fbuf, fbufSize);
+    close(ifd);
+    throw;
+  }
+  if (fbuf) explicit_bzero(fbuf, fbufSize);
+  close(ifd);
+}
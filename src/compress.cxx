@@ -0,0 +1,145 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <cstring>
+
+//
+// Built in LZ compression of chunks.
+//
+// A compressed chunk is a run of sequences. Every sequence is a
+// token, the length of its literals, the literals, then a match: two
+// bytes of little endian offset back into output and its length. The
+// high half of token holds literal length, the low half match length
+// minus four. A half of 15 goes on in bytes that are added up, while
+// they are 255. The last sequence has literals only.
+//
+
+// Shortest match worth a sequence.
+static const size_t g_minMatch{4};
+// Farthest a match can reach back.
+static const size_t g_maxOffset{65535};
+// Number of bits of match finder hash.
+static const unsigned g_hashBits{14};
+
+// Read 4 bytes as they are.
+static std::uint32_t load32(const unsigned char* p)
+{
+  std::uint32_t v{};
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Write a length that went past its token half. Return false if
+// there is no room left.
+static bool put_length(unsigned char*& op, const unsigned char* end, size_t length)
+{
+  while (length >= 255)
+  {
+    if (op == end) return false;
+    *op++ = 255;
+    length -= 255;
+  }
+  if (op == end) return false;
+  *op++ = static_cast<unsigned char>(length);
+  return true;
+}
+
+// Write a sequence. Return false if there is no room left.
+static bool put_sequence(unsigned char*& op, const unsigned char* end, const unsigned char* literals, size_t nliterals, size_t offset, size_t matchlen)
+{
+  if (op == end) return false;
+  unsigned char* token{op++};
+  *token = static_cast<unsigned char>(std::min<size_t>(nliterals, 15) << 4);
+  if (nliterals >= 15 and !put_length(op, end, nliterals - 15)) return false;
+  if (static_cast<size_t>(end - op) < nliterals) return false;
+  std::memcpy(op, literals, nliterals);
+  op += nliterals;
+  if (matchlen == 0) return true;
+  if (end - op < 2) return false;
+  *op++ = static_cast<unsigned char>(offset & 0xff);
+  *op++ = static_cast<unsigned char>(offset >> 8);
+  *token |= static_cast<unsigned char>(std::min<size_t>(matchlen - g_minMatch, 15));
+  return matchlen - g_minMatch < 15 or put_length(op, end, matchlen - g_minMatch - 15);
+}
+
+//
+// Compress n bytes of src into dst, which has room for cap bytes.
+// Return compressed size, or zero if it doesn't fit, in which case
+// the chunk is better stored as it is.
+//
+size_t Krenq::compress_chunk(const unsigned char* src, size_t n, unsigned char* dst, size_t cap)
+{
+  // Positions plus one, zero for none.
+  auto* table{reinterpret_cast<std::uint32_t*>(this->arena_buffer(Krenq::ArenaSlot::matches, sizeof(std::uint32_t) << g_hashBits))};
+  std::memset(table, 0, sizeof(std::uint32_t) << g_hashBits);
+  unsigned char* op{dst};
+  const unsigned char* end{dst + cap};
+  size_t anchor{0};
+  size_t i{0};
+  while (i + g_minMatch <= n)
+  {
+    std::uint32_t v{load32(src + i)};
+    std::uint32_t h{(v * 2654435761u) >> (32 - g_hashBits)};
+    size_t candidate{table[h]};
+    table[h] = static_cast<std::uint32_t>(i + 1);
+    if (candidate == 0 or i + 1 - candidate > g_maxOffset or load32(src + candidate - 1) != v)
+    {
+      ++i;
+      continue;
+    }
+    --candidate;
+    size_t matchlen{g_minMatch};
+    while (i + matchlen < n and src[candidate + matchlen] == src[i + matchlen]) ++matchlen;
+    if (!put_sequence(op, end, src + anchor, i - anchor, i - candidate, matchlen)) return 0;
+    i += matchlen;
+    anchor = i;
+  }
+  if (!put_sequence(op, end, src + anchor, n - anchor, 0, 0)) return 0;
+  return static_cast<size_t>(op - dst);
+}
+
+//
+// Decompress n bytes of src into dst, which has room for cap bytes.
+// Return decompressed size, or cap + 1 if src is malformed.
+//
+size_t Krenq::decompress_chunk(const unsigned char* src, size_t n, unsigned char* dst, size_t cap)
+{
+  const unsigned char* ip{src};
+  const unsigned char* iend{src + n};
+  size_t out{0};
+  auto get_length{[&](size_t length)
+  {
+    if (length != 15) return length;
+    while (ip < iend)
+    {
+      unsigned char b{*ip++};
+      length += b;
+      if (b != 255) break;
+    }
+    return length;
+  }};
+  while (ip < iend)
+  {
+    unsigned char token{*ip++};
+    size_t nliterals{get_length(token >> 4)};
+    if (static_cast<size_t>(iend - ip) < nliterals or cap - out < nliterals) return cap + 1;
+    std::memcpy(dst + out, ip, nliterals);
+    ip += nliterals;
+    out += nliterals;
+    // The last sequence has literals only.
+    if (ip == iend) break;
+    if (iend - ip < 2) return cap + 1;
+    size_t offset{static_cast<size_t>(ip[0]) | static_cast<size_t>(ip[1]) << 8};
+    ip += 2;
+    size_t matchlen{get_length(token & 0x0f) + g_minMatch};
+    if (offset == 0 or offset > out or cap - out < matchlen) return cap + 1;
+    // Byte by byte, as a match may overlap its own output.
+    for (size_t m{}; m < matchlen; ++m, ++out) dst[out] = dst[out - offset];
+  }
+  return out;
+}
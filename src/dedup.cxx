@@ -0,0 +1,489 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+//
+// Deduplicated format.
+//
+// Plain data is cut into chunks where its content says so, and every
+// distinct chunk is kept once in a chunk store, XOR'ed with the key,
+// compressed if compression is on. Files become manifests listing
+// their chunks.
+//
+// Header: plain file hash, pattern, manifest marker, pattern.
+// Manifest header: magic, version, 3 reserved bytes, plain size and
+// number of entries, little endian.
+// Entries: hash and length of every chunk, XOR'ed with the key by
+// offset past the manifest header.
+// Trailer: encrypted key hash.
+//
+// Chunks are named by the hash of key and chunk hash, so neither the
+// plain data nor what is shared between keys shows in the store.
+//
+
+// Size of header: plain file hash, pattern, marker, pattern.
+static const size_t g_headerSize{32 + 12 + 1 + 12};
+// Size of trailer: encrypted key hash.
+static const size_t g_keyHashSize{32};
+// Size of manifest header.
+static const size_t g_manifestHeaderSize{24};
+// Size of a manifest entry: chunk hash and chunk length.
+static const size_t g_entrySize{32 + 4};
+// Magic of manifest header and the only version there is.
+static const char g_manifestMagic[4]{'K', 'R', 'Q', 'M'};
+static const unsigned char g_manifestVersion{1};
+// Smallest, average and largest chunk. A cut is made where the top
+// 16 bits of the rolling hash are all zero, once every 64 KiB.
+static const size_t g_minCut{16 * 1024};
+static const size_t g_maxCut{256 * 1024};
+static const std::uint64_t g_cutMask{0xffffull << 48};
+// Plain data read at once.
+static const size_t g_dedupBuffer{16 * g_maxCut};
+
+// Random value of every byte for the rolling hash, fixed for good.
+static constexpr std::array<std::uint64_t, 256> make_gear()
+{
+  std::array<std::uint64_t, 256> gear{};
+  std::uint64_t state{0x6b72656e71636463ull};
+  for (auto& g : gear)
+  {
+    // splitmix64
+    state += 0x9e3779b97f4a7c15ull;
+    std::uint64_t z{state};
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    g = z ^ (z >> 31);
+  }
+  return gear;
+}
+static constexpr std::array<std::uint64_t, 256> g_gear{make_gear()};
+
+//
+// Length of the chunk at the start of given data. The rolling hash
+// only looks at the bytes past the smallest chunk, so cuts depend on
+// content alone and come back after an insert or removal upstream.
+//
+static size_t find_cut(const unsigned char* data, size_t n)
+{
+  if (n <= g_minCut) return n;
+  size_t end{std::min(n, g_maxCut)};
+  std::uint64_t hash{0};
+  for (size_t i{g_minCut}; i < end; ++i)
+  {
+    hash = (hash << 1) + g_gear[data[i]];
+    if ((hash & g_cutMask) == 0) return i + 1;
+  }
+  return end;
+}
+
+// SHA-256 of given data.
+static void sha256_of(const void* data, size_t n, std::array<char, 32>& hash)
+{
+  struct Sha_256 sha_256;
+  sha_256_init(&sha_256, reinterpret_cast<std::uint8_t*>(hash.data()));
+  sha_256_write(&sha_256, data, n);
+  sha_256_close(&sha_256);
+}
+
+// Write n bytes of value in little endian.
+static void put_le(std::string& out, std::uint64_t value, size_t n)
+{
+  for (size_t i{}; i < n; ++i) out += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+// Write value in decimal.
+static void put_decimal(std::string& out, std::uint64_t value)
+{
+  char digits[20]{};
+  auto [end, ec]{std::to_chars(std::begin(digits), std::end(digits), value)};
+  out.append(digits, end);
+}
+
+// Read n bytes of little endian value.
+static std::uint64_t get_le(const unsigned char* in, size_t n)
+{
+  std::uint64_t value{};
+  for (size_t i{n}; i > 0; --i) value = (value << 8) | in[i - 1];
+  return value;
+}
+
+//
+// Deduplicate plain data of encrypted files through a chunk store at
+// given directory, which is created if needed. Empty turns it off.
+// Chunks stay in the store until sweep_store() finds them unused.
+//
+void Krenq::set_dedup(const std::string& store)
+{
+  this->flush_commits();
+  if (!store.empty()) fs::create_directories(store);
+  m_dedupStore = store;
+}
+
+// Path of a chunk in chunk store, into path.
+void Krenq::chunk_path(const std::array<char, 32>& id, const Krenq::KeyTile& key, std::string& path)
+{
+  static const char digits[]{"0123456789abcdef"};
+  struct Sha_256 sha_256;
+  std::array<std::uint8_t, 32> name{};
+  sha_256_init(&sha_256, name.data());
+  sha_256_write(&sha_256, key.s_key.data(), key.s_key.size());
+  sha_256_write(&sha_256, id.data(), id.size());
+  sha_256_close(&sha_256);
+  path.assign(m_dedupStore);
+  for (size_t i{}; i < name.size(); ++i)
+  {
+    if (i < 2) path += '/';
+    path += digits[name[i] >> 4];
+    path += digits[name[i] & 0x0f];
+  }
+}
+
+//
+// Put a chunk into chunk store unless it's there already. Return true
+// if it was written. Chunks are written to a temporary file first, so
+// a chunk found in store is always whole, and workers storing the
+// same chunk at once simply write the same bytes.
+//
+bool Krenq::store_chunk(const unsigned char* data, size_t n, const std::array<char, 32>& id, const Krenq::KeyTile& key)
+{
+  std::string& path{this->arena().s_chunkPath};
+  this->chunk_path(id, key, path);
+  if (access(path.c_str(), F_OK) == 0) return false;
+  unsigned char* sbuf{this->arena_buffer(Krenq::ArenaSlot::compressed, n)};
+  size_t length{m_compression ? this->compress_chunk(data, n, sbuf, n - 1) : 0};
+  if (length == 0)
+  {
+    std::memcpy(sbuf, data, n);
+    length = n;
+  }
+  this->apply_key(sbuf, length, 0, key);
+  // Directory of the chunk is made right under the store, the store
+  // itself only if it went missing.
+  std::string& tempname{this->arena().s_chunkTemp};
+  tempname.assign(path, 0, m_dedupStore.size() + 3);
+  if (mkdir(tempname.c_str(), 0777) != 0 and errno == ENOENT) fs::create_directories(tempname);
+  tempname.assign(path);
+  tempname += ".krenqchunktemp.";
+  put_decimal(tempname, static_cast<std::uint64_t>(getpid()));
+  tempname += '.';
+  put_decimal(tempname, m_chunkTemps++);
+  Krenq::OutputFile ofile{};
+  try
+  {
+    this->output_open(ofile, tempname, length, 0);
+    this->output_write(ofile, sbuf, length);
+    this->output_close(ofile, {});
+  }
+  catch (...)
+  {
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  this->commit_chunk(tempname, path);
+  return true;
+}
+
+//
+// Read a chunk of given manifest entry from chunk store into buffer,
+// decrypted and decompressed. Buffer holds twice the largest chunk.
+// Throws if it is missing or doesn't match its hash.
+//
+void Krenq::load_chunk(const Krenq::ManifestEntry& entry, const Krenq::KeyTile& key, unsigned char* fbuf)
+{
+  std::string& path{this->arena().s_chunkPath};
+  this->chunk_path(entry.s_id, key, path);
+  int fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) throw std::runtime_error{"Chunk " + path + " is missing from store!"};
+  struct stat st{};
+  size_t length{0};
+  size_t n{entry.s_length};
+  if (fstat(fd, &st) == 0) length = static_cast<size_t>(st.st_size);
+  // Compressed chunks are read past the plain one and inflated in front.
+  unsigned char* payload{length < n ? fbuf + n : fbuf};
+  bool read{length > 0 and length <= n and this->input_read(fd, payload, length, 0) == length};
+  close(fd);
+  if (read)
+  {
+    this->apply_key(payload, length, 0, key);
+    read = length == n or this->decompress_chunk(payload, length, fbuf, n) == n;
+  }
+  std::array<char, 32> id{};
+  if (read) sha256_of(fbuf, n, id);
+  if (!read or id != entry.s_id)
+    throw std::runtime_error{"Chunk " + path + " in store is corrupted!"};
+}
+
+//
+// Read manifest of a deduplicated file. Plain file hash goes to hash.
+// Return false if it is not a manifest or if its sizes don't add up.
+// The manifest is read into the arena, so is best given entries and
+// hash of the arena too.
+//
+bool Krenq::read_manifest(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, std::string& hash, std::vector<Krenq::ManifestEntry>& entries)
+{
+  if (filesize < g_headerSize + g_manifestHeaderSize + g_keyHashSize) return false;
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  std::string& raw{this->arena().s_manifest};
+  raw.resize(filesize - g_keyHashSize);
+  bool read{this->input_read(ifd, reinterpret_cast<unsigned char*>(raw.data()), raw.size(), 0) == raw.size()};
+  close(ifd);
+  if (!read) return false;
+  const unsigned char* mh{reinterpret_cast<const unsigned char*>(raw.data()) + g_headerSize};
+  if (std::memcmp(mh, g_manifestMagic, sizeof(g_manifestMagic)) != 0 or mh[4] != g_manifestVersion) return false;
+  std::uint64_t plainSize{get_le(mh + 8, 8)};
+  std::uint64_t count{get_le(mh + 16, 8)};
+  size_t bodysize{raw.size() - g_headerSize - g_manifestHeaderSize};
+  if (count == 0 or bodysize % g_entrySize != 0 or bodysize / g_entrySize != count) return false;
+  unsigned char* body{reinterpret_cast<unsigned char*>(raw.data()) + g_headerSize + g_manifestHeaderSize};
+  this->apply_key(body, bodysize, 0, key);
+  hash.assign(raw.data(), 32);
+  entries.resize(count);
+  std::uint64_t total{0};
+  for (size_t i{}; i < count; ++i)
+  {
+    const unsigned char* e{body + i * g_entrySize};
+    std::memcpy(entries[i].s_id.data(), e, entries[i].s_id.size());
+    entries[i].s_length = static_cast<std::uint32_t>(get_le(e + 32, 4));
+    if (entries[i].s_length == 0 or entries[i].s_length > g_maxCut) return false;
+    total += entries[i].s_length;
+  }
+  return total == plainSize;
+}
+
+// Append manifest of given entries to out, entries XOR'ed with the key.
+void Krenq::pack_manifest(std::uint64_t plainSize, const std::vector<Krenq::ManifestEntry>& entries, const Krenq::KeyTile& key, std::string& out)
+{
+  out.append(g_manifestMagic, sizeof(g_manifestMagic));
+  put_le(out, g_manifestVersion, 1);
+  put_le(out, 0, 3);
+  put_le(out, plainSize, 8);
+  put_le(out, entries.size(), 8);
+  size_t body{out.size()};
+  for (auto& entry : entries)
+  {
+    out.append(entry.s_id.data(), entry.s_id.size());
+    put_le(out, entry.s_length, 4);
+  }
+  this->apply_key(reinterpret_cast<unsigned char*>(out.data()) + body, out.size() - body, 0, key);
+}
+
+//
+// Write deduplicated form of a plain file and replace the file with
+// it. The plain file is read once, cut into chunks, and chunks the
+// store lacks are put into it. Only the manifest is written in place
+// of the file.
+//
+bool Krenq::write_encrypted_dedup(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& prefix, const std::string& kenhash, const std::string& tempname)
+{
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return false;
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Krenq::OutputFile ofile{};
+  try
+  {
+    struct Sha_256 sha_256;
+    std::array<std::uint8_t, 32> sha256Hash{};
+    sha_256_init(&sha_256, sha256Hash.data());
+    std::vector<Krenq::ManifestEntry>& entries{this->arena().s_entries};
+    entries.clear();
+    unsigned char* ibuf{this->arena_buffer(Krenq::ArenaSlot::input, g_dedupBuffer)};
+    size_t used{0};
+    for (std::uint64_t offset{}; offset < filesize or used > 0;)
+    {
+      // Keep at least a largest chunk in buffer until the end.
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(g_dedupBuffer - used, filesize - offset))};
+      if (this->input_read(ifd, ibuf + used, n, offset) != n)
+        throw std::runtime_error{"File shrank while being encrypted: " + filename};
+      sha_256_write(&sha_256, ibuf + used, n);
+      offset += n;
+      used += n;
+      size_t pos{0};
+      while (pos < used and (offset == filesize or used - pos >= g_maxCut))
+      {
+        size_t cut{find_cut(ibuf + pos, used - pos)};
+        Krenq::ManifestEntry& entry{entries.emplace_back(Krenq::ManifestEntry{{}, static_cast<std::uint32_t>(cut)})};
+        sha256_of(ibuf + pos, cut, entry.s_id);
+        this->store_chunk(ibuf + pos, cut, entry.s_id, key);
+        pos += cut;
+      }
+      std::memmove(ibuf, ibuf + pos, used - pos);
+      used -= pos;
+    }
+    sha_256_close(&sha_256);
+    std::string& manifest{this->arena().s_manifest};
+    manifest.assign(reinterpret_cast<const char*>(sha256Hash.data()), sha256Hash.size());
+    manifest += prefix;
+    this->pack_manifest(filesize, entries, key, manifest);
+    manifest += kenhash;
+    this->output_open(ofile, tempname, manifest.size(), 0);
+    this->output_write(ofile, manifest.data(), manifest.size());
+    this->output_close(ofile, {});
+  }
+  catch (...)
+  {
+    close(ifd);
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  close(ifd);
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+// Write plain form of a deduplicated file and replace the file with it.
+bool Krenq::write_decrypted_dedup(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& tempname)
+{
+  std::string& hash{this->arena().s_hash};
+  std::vector<Krenq::ManifestEntry>& entries{this->arena().s_entries};
+  if (!this->read_manifest(filename, filesize, key, hash, entries)) return false;
+  std::uint64_t plainSize{0};
+  for (auto& entry : entries) plainSize += entry.s_length;
+  Krenq::OutputFile ofile{};
+  try
+  {
+    this->output_open(ofile, tempname, plainSize, 0);
+    unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, 2 * g_maxCut)};
+    for (auto& entry : entries)
+    {
+      this->load_chunk(entry, key, fbuf);
+      this->output_write(ofile, fbuf, entry.s_length);
+    }
+    this->output_close(ofile, {});
+  }
+  catch (...)
+  {
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+//
+// Move a deduplicated file to the new key. Its chunks are put into
+// store under the new key, then its manifest is rewritten. Chunks
+// under the old key stay, other files may still need them.
+//
+bool Krenq::rekey_manifest(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& oldKey, const Krenq::KeyTile& newKey)
+{
+  std::string& hash{this->arena().s_hash};
+  std::vector<Krenq::ManifestEntry>& entries{this->arena().s_entries};
+  if (!this->read_manifest(filename, filesize, oldKey, hash, entries)) return false;
+  std::uint64_t plainSize{0};
+  unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, 2 * g_maxCut)};
+  for (auto& entry : entries)
+  {
+    this->load_chunk(entry, oldKey, fbuf);
+    this->store_chunk(fbuf, entry.s_length, entry.s_id, newKey);
+    plainSize += entry.s_length;
+  }
+  std::string& prefix{this->arena().s_prefix};
+  this->make_manifest_prefix(prefix);
+  std::string& manifest{this->arena().s_manifest};
+  manifest.assign(hash);
+  manifest += prefix;
+  this->pack_manifest(plainSize, entries, newKey, manifest);
+  manifest += newKey.s_keyHash;
+  std::string& tempname{this->arena().s_tempname};
+  tempname.assign(filename);
+  tempname += ".krenqrekeytemp";
+  Krenq::OutputFile ofile{};
+  try
+  {
+    this->output_open(ofile, tempname, manifest.size(), 0);
+    this->output_write(ofile, manifest.data(), manifest.size());
+    this->output_close(ofile, {});
+  }
+  catch (...)
+  {
+    this->output_abort(ofile, tempname);
+    throw;
+  }
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+//
+// Delete chunks of chunk store that no manifest under entries lists,
+// as left behind by files decrypted or re-encrypted since. Manifests
+// are read with keys of key ring. Every file using the store has to
+// be under entries, since chunks of any other file are deleted too.
+// A manifest that can't be read stops the sweep before anything is
+// deleted. Temporary files of chunks being written are left alone,
+// but nothing should be encrypted into the store meanwhile.
+//
+Krenq::SweepReport Krenq::sweep_store()
+{
+  if (m_dedupStore.empty())
+    throw std::runtime_error{"Set a chunk store using set_dedup() before sweeping it!"};
+  if (m_keyRing.empty())
+    throw std::runtime_error{"Load keys using load_key_ring() before sweeping chunk store!"};
+  this->flush_commits();
+  // Paths of chunks in use, relative to the store.
+  std::unordered_set<std::string> used{};
+  std::string failed{};
+  std::mutex mutex{};
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(m_entries)};
+  this->run_jobs(queues, [&](const Krenq::FileJob& file)
+  {
+    Krenq::EStatus estatus{this->krenq_status(file.s_path)};
+    if (!estatus.s_encrypted or !this->is_manifest(estatus)) return;
+    auto iter{m_keyRing.find(estatus.key_hash())};
+    std::string hash{};
+    std::vector<Krenq::ManifestEntry> entries{};
+    std::vector<std::string> paths{};
+    std::string path{};
+    bool read{iter != m_keyRing.end() and this->read_manifest(file.s_path, estatus.s_size, *iter->second, hash, entries)};
+    for (auto& entry : entries)
+    {
+      this->chunk_path(entry.s_id, *iter->second, path);
+      paths.emplace_back(path.substr(m_dedupStore.size()));
+    }
+    std::lock_guard<std::mutex> lock{mutex};
+    if (!read and failed.empty()) failed = file.s_path;
+    for (auto& path : paths) used.emplace(std::move(path));
+  });
+  if (!failed.empty())
+    throw std::runtime_error{"Cannot read manifest of " + failed + " with key ring, nothing swept!"};
+
+  Krenq::SweepReport report{};
+  for (auto& dir : fs::directory_iterator{m_dedupStore})
+  {
+    if (!dir.is_directory()) continue;
+    for (auto& chunk : fs::directory_iterator{dir.path()})
+    {
+      std::string name{chunk.path().filename().string()};
+      // Chunks are named by 62 hex digits, temporary files by more.
+      if (!chunk.is_regular_file() or name.size() != 62) continue;
+      if (used.contains('/' + dir.path().filename().string() + '/' + name))
+      {
+        ++report.s_kept;
+        continue;
+      }
+      std::uint64_t size{chunk.file_size()};
+      fs::remove(chunk.path());
+      ++report.s_removed;
+      report.s_bytes += size;
+    }
+  }
+  return report;
+}
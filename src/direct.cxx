@@ -0,0 +1,425 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Alignment of buffers, offsets and lengths of direct I/O. A 4 KiB
+// alignment satisfies devices of 512 byte and of 4 KiB sectors.
+static const size_t g_directAlign{4096};
+// Size of each aligned buffer.
+static const size_t g_directChunk{1024 * 1024};
+// Size of header and trailer of an encrypted file.
+static const size_t g_headerSize{32 + 12 + 1 + 12};
+static const size_t g_keyHashSize{32};
+static const size_t g_blockSize{154};
+
+namespace
+{
+  //
+  // Writes aligned buffers from a thread of its own, so the next
+  // buffer is read and transformed while the previous one is still
+  // on its way to the disk. A writer serves one file at a time and
+  // is kept from file to file.
+  //
+  class DirectWriter
+  {
+  public:
+    DirectWriter()
+      : m_thread{[this]{ this->run(); }}
+    {
+    }
+
+    ~DirectWriter()
+    {
+      {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_quit = true;
+      }
+      m_cv.notify_all();
+      m_thread.join();
+    }
+
+    // Start writing to another file.
+    void start(int fd)
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      m_fd = fd;
+      m_error = 0;
+    }
+
+    // Queue a buffer, after the previously queued one is written.
+    void submit(const unsigned char* buf, size_t len, std::uint64_t offset)
+    {
+      this->wait();
+      {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_buf = buf;
+        m_len = len;
+        m_offset = offset;
+        m_pending = true;
+      }
+      m_cv.notify_all();
+    }
+
+    // Wait until queued buffer is written. Throws if it failed.
+    void wait()
+    {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      m_cv.wait(lock, [this]{ return !m_pending; });
+      if (m_error != 0)
+        throw std::runtime_error{std::string{"Direct write failed: "} + std::strerror(m_error)};
+    }
+
+    // Wait until queued buffer is written, whether it failed or not.
+    void drain()
+    {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      m_cv.wait(lock, [this]{ return !m_pending; });
+    }
+
+  private:
+    void run()
+    {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      while (true)
+      {
+        m_cv.wait(lock, [this]{ return m_pending or m_quit; });
+        if (!m_pending) return;
+        lock.unlock();
+        int error{0};
+        for (size_t done{}; done < m_len and error == 0;)
+        {
+          ssize_t w{pwrite(m_fd, m_buf + done, m_len - done, static_cast<off_t>(m_offset + done))};
+          if (w < 0 and errno != EINTR) error = errno;
+          else if (w > 0) done += static_cast<size_t>(w);
+        }
+        lock.lock();
+        if (m_error == 0) m_error = error;
+        m_pending = false;
+        m_cv.notify_all();
+      }
+    }
+
+    int m_fd{-1};
+    const unsigned char* m_buf{};
+    size_t m_len{};
+    std::uint64_t m_offset{};
+    bool m_pending{false};
+    bool m_quit{false};
+    int m_error{0};
+    std::mutex m_mutex{};
+    std::condition_variable m_cv{};
+    std::thread m_thread;
+  };
+
+  //
+  // Writer kept in given slot of an arena, started on its first
+  // direct file. It lives as long as the arena, across files and runs.
+  //
+  DirectWriter& direct_writer(std::shared_ptr<void>& slot)
+  {
+    if (!slot) slot = std::make_shared<DirectWriter>();
+    return *static_cast<DirectWriter*>(slot.get());
+  }
+}
+
+// Round up to direct I/O alignment.
+static std::uint64_t align_up(std::uint64_t n)
+{
+  return (n + g_directAlign - 1) / g_directAlign * g_directAlign;
+}
+
+// Read at an aligned offset with direct I/O. Less is returned only at end of file.
+static size_t direct_read(int fd, unsigned char* buf, size_t n, std::uint64_t offset)
+{
+  size_t done{0};
+  while (done < n)
+  {
+    ssize_t r{pread(fd, buf + done, n - done, static_cast<off_t>(offset + done))};
+    if (r < 0 and errno == EINTR) continue;
+    if (r < 0) throw std::runtime_error{std::string{"Direct read failed: "} + std::strerror(errno)};
+    if (r == 0) break;
+    done += static_cast<size_t>(r);
+    // A short direct read means end of file.
+    if (done % g_directAlign != 0) break;
+  }
+  return done;
+}
+
+// Turn direct I/O on or off.
+void Krenq::set_direct_io(bool direct)
+{
+  m_directIo = direct;
+}
+
+// Take an aligned buffer from the pool, allocating if pool is empty.
+unsigned char* Krenq::acquire_buffer()
+{
+  {
+    std::lock_guard<std::mutex> lock{m_bufferMutex};
+    if (!m_alignedBuffers.empty())
+    {
+      unsigned char* buf{m_alignedBuffers.back()};
+      m_alignedBuffers.pop_back();
+      return buf;
+    }
+  }
+  void* buf{nullptr};
+  if (posix_memalign(&buf, g_directAlign, g_directChunk) != 0)
+    throw std::bad_alloc{};
+  return static_cast<unsigned char*>(buf);
+}
+
+// Return an aligned buffer to the pool.
+void Krenq::release_buffer(unsigned char* buf)
+{
+  std::lock_guard<std::mutex> lock{m_bufferMutex};
+  m_alignedBuffers.emplace_back(buf);
+}
+
+//
+// Direct I/O version of write_encrypted().
+//
+// Plain data is read in aligned chunks. Output is assembled in two
+// aligned staging buffers, one being filled while the other one is
+// written. The header is unknown until all data is hashed, so its
+// place is left blank and the first aligned block, kept aside, is
+// written again with the header at the end. The tail is written
+// rounded up to the alignment and the file is truncated back after.
+//
+// Filesystems without direct I/O support fall back to buffered I/O.
+//
+bool Krenq::write_encrypted_direct(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& prefix, const std::string& kenhash, const std::string& tempname)
+{
+  DirectWriter& writer{direct_writer(this->arena().s_directWriter)};
+  int ifd{open(filename.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC)};
+  if (ifd < 0 and errno == EINVAL)
+    return this->write_encrypted(filename, filesize, key, prefix, kenhash, tempname);
+  if (ifd < 0) return false;
+  int ofd{open(tempname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0666)};
+  if (ofd < 0)
+  {
+    int error{errno};
+    close(ifd);
+    if (error == EINVAL)
+      return this->write_encrypted(filename, filesize, key, prefix, kenhash, tempname);
+    throw std::runtime_error{"Failed to create " + tempname + ": " + std::strerror(error)};
+  }
+  std::uint64_t padded{this->padded_size(filesize)};
+  std::uint64_t total{g_headerSize + padded + g_keyHashSize};
+  fallocate(ofd, 0, 0, static_cast<off_t>(total));
+
+  std::array<unsigned char*, 4> bufs{};
+  try
+  {
+    writer.start(ofd);
+    for (auto& buf : bufs) buf = this->acquire_buffer();
+    unsigned char* ibuf{bufs[0]};
+    unsigned char* first{bufs[1]};
+    std::array<unsigned char*, 2> stage{bufs[2], bufs[3]};
+    size_t cur{0};
+    size_t used{g_headerSize};
+    std::uint64_t stageOffset{0};
+    std::memset(stage[cur], 0, g_headerSize);
+    // Hand a full (or the final) staging buffer to the writer.
+    auto submit{[&](size_t len)
+    {
+      std::memset(stage[cur] + len, 0, align_up(len) - len);
+      if (stageOffset == 0) std::memcpy(first, stage[cur], g_directAlign);
+      this->throttle_write(align_up(len));
+      writer.submit(stage[cur], align_up(len), stageOffset);
+      stageOffset += len;
+      cur ^= 1;
+      used = 0;
+    }};
+    auto append{[&](const unsigned char* data, size_t n)
+    {
+      while (n > 0)
+      {
+        size_t len{std::min(n, g_directChunk - used)};
+        std::memcpy(stage[cur] + used, data, len);
+        used += len;
+        data += len;
+        n -= len;
+        if (used == g_directChunk) submit(used);
+      }
+    }};
+
+    struct Sha_256 sha_256;
+    std::array<std::uint8_t, 32> sha256Hash{};
+    sha_256_init(&sha_256, sha256Hash.data());
+    for (std::uint64_t offset{}; offset < filesize;)
+    {
+      this->throttle_read(g_directChunk);
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(direct_read(ifd, ibuf, g_directChunk, offset), filesize - offset))};
+      if (n == 0)
+        throw std::runtime_error{"File shrank while being encrypted: " + filename};
+      sha_256_write(&sha_256, ibuf, n);
+      this->apply_key(ibuf, n, offset, key);
+      append(ibuf, n);
+      offset += n;
+    }
+    std::array<unsigned char, g_blockSize> padding{};
+    size_t padn{this->add_padding(padding.data(), filesize)};
+    this->apply_key(padding.data(), padn, filesize, key);
+    append(padding.data(), padn);
+    append(reinterpret_cast<const unsigned char*>(kenhash.data()), kenhash.size());
+    if (used > 0) submit(used);
+    writer.wait();
+
+    // Put the header in place.
+    sha_256_close(&sha_256);
+    std::memcpy(first, sha256Hash.data(), sha256Hash.size());
+    std::memcpy(first + sha256Hash.size(), prefix.data(), prefix.size());
+    this->throttle_write(g_directAlign);
+    writer.submit(first, g_directAlign, 0);
+    writer.wait();
+    if (ftruncate(ofd, static_cast<off_t>(total)) != 0)
+      throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+    this->sync_output(ofd);
+    if (close(ofd) != 0)
+      throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+    ofd = -1;
+  }
+  catch (...)
+  {
+    writer.drain();
+    for (auto buf : bufs)
+      if (buf) this->release_buffer(buf);
+    close(ifd);
+    if (ofd >= 0) close(ofd);
+    unlink(tempname.c_str());
+    throw;
+  }
+  for (auto buf : bufs) this->release_buffer(buf);
+  close(ifd);
+  this->commit_file(tempname, filename);
+  return true;
+}
+
+//
+// Direct I/O version of write_decrypted().
+//
+// Reading starts at offset 0 as direct reads have to be aligned, and
+// the header is skipped in memory. The last block is looked up first
+// to learn the padding, through the aligned window containing it.
+//
+bool Krenq::write_decrypted_direct(const std::string& filename, std::uint64_t filesize, const Krenq::KeyTile& key, const std::string& tempname)
+{
+  DirectWriter& writer{direct_writer(this->arena().s_directWriter)};
+  int ifd{open(filename.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC)};
+  if (ifd < 0 and errno == EINVAL)
+    return this->write_decrypted(filename, filesize, key, tempname);
+  if (ifd < 0) return false;
+  int ofd{open(tempname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0666)};
+  if (ofd < 0)
+  {
+    int error{errno};
+    close(ifd);
+    if (error == EINVAL)
+      return this->write_decrypted(filename, filesize, key, tempname);
+    throw std::runtime_error{"Failed to create " + tempname + ": " + std::strerror(error)};
+  }
+  std::uint64_t bodysize{(filesize - (g_headerSize + g_keyHashSize)) / g_blockSize * g_blockSize};
+  std::uint64_t bodyEnd{g_headerSize + bodysize};
+
+  std::array<unsigned char*, 3> bufs{};
+  std::uint64_t plainsize{};
+  try
+  {
+    writer.start(ofd);
+    for (auto& buf : bufs) buf = this->acquire_buffer();
+    unsigned char* ibuf{bufs[0]};
+    std::array<unsigned char*, 2> stage{bufs[1], bufs[2]};
+
+    // Learn the padding from the last block.
+    std::uint64_t lastBlock{bodyEnd - g_blockSize};
+    std::uint64_t window{lastBlock / g_directAlign * g_directAlign};
+    this->throttle_read(align_up(bodyEnd) - window);
+    if (direct_read(ifd, ibuf, align_up(bodyEnd) - window, window) < bodyEnd - window)
+      throw std::runtime_error{"Failed to read " + filename};
+    std::array<unsigned char, g_blockSize> last{};
+    std::memcpy(last.data(), ibuf + (lastBlock - window), g_blockSize);
+    this->apply_key(last.data(), g_blockSize, 0, key);
+    plainsize = bodysize - this->remove_padding(last.data());
+    fallocate(ofd, 0, 0, static_cast<off_t>(plainsize));
+
+    size_t cur{0};
+    size_t used{0};
+    std::uint64_t stageOffset{0};
+    for (std::uint64_t offset{}; offset < g_headerSize + plainsize;)
+    {
+      this->throttle_read(g_directChunk);
+      size_t n{direct_read(ifd, ibuf, g_directChunk, offset)};
+      if (n == 0)
+        throw std::runtime_error{"File shrank while being decrypted: " + filename};
+      // Cut the header off the front and padding and trailer off the back.
+      size_t skip{offset < g_headerSize ? static_cast<size_t>(g_headerSize - offset) : 0};
+      size_t end{static_cast<size_t>(std::min<std::uint64_t>(n, g_headerSize + plainsize - offset))};
+      offset += n;
+      if (end <= skip) continue;
+      unsigned char* data{ibuf + skip};
+      size_t len{end - skip};
+      this->apply_key(data, len, offset - n + skip - g_headerSize, key);
+      while (len > 0)
+      {
+        size_t part{std::min(len, g_directChunk - used)};
+        std::memcpy(stage[cur] + used, data, part);
+        used += part;
+        data += part;
+        len -= part;
+        if (used == g_directChunk)
+        {
+          this->throttle_write(used);
+          writer.submit(stage[cur], used, stageOffset);
+          stageOffset += used;
+          cur ^= 1;
+          used = 0;
+        }
+      }
+    }
+    if (used > 0)
+    {
+      std::memset(stage[cur] + used, 0, align_up(used) - used);
+      this->throttle_write(align_up(used));
+      writer.submit(stage[cur], align_up(used), stageOffset);
+    }
+    writer.wait();
+    if (ftruncate(ofd, static_cast<off_t>(plainsize)) != 0)
+      throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+    this->sync_output(ofd);
+    if (close(ofd) != 0)
+      throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+    ofd = -1;
+  }
+  catch (...)
+  {
+    writer.drain();
+    for (auto buf : bufs)
+      if (buf) this->release_buffer(buf);
+    close(ifd);
+    if (ofd >= 0) close(ofd);
+    unlink(tempname.c_str());
+    throw;
+  }
+  for (auto buf : bufs) this->release_buffer(buf);
+  close(ifd);
+  this->commit_file(tempname, filename);
+  return true;
+}
@@ -0,0 +1,179 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+//
+// Set durability mode.
+//
+// none:     Temporary file simply replaces the original. Fastest, but
+//           after a power loss a file may be empty or half written.
+// per_file: Temporary file is synced before it replaces the original,
+//           and the directory is synced after.
+// batched:  Temporary files are left in place and replace their
+//           originals in groups. Each group is synced with a single
+//           syncfs per filesystem, then renamed, then synced again.
+//           A crash leaves every file either old or new.
+//
+void Krenq::set_durability(Krenq::Durability durability, size_t batchFiles, size_t batchMs)
+{
+  if (batchFiles == 0)
+    throw std::runtime_error{"A batch needs at least one file!"};
+  this->flush_commits();
+  m_durability = durability;
+  m_batchFiles = batchFiles;
+  m_batchInterval = std::chrono::milliseconds{batchMs};
+}
+
+// Sync output file if every file has to be made durable on its own.
+void Krenq::sync_output(int fd)
+{
+  if (m_durability != Krenq::Durability::per_file) return;
+  if (fsync(fd) != 0)
+    throw std::runtime_error{std::string{"Sync failed: "} + std::strerror(errno)};
+}
+
+// Sync directory containing given file. Its path is cut out on the
+// stack, so syncing every file allocates nothing.
+static void sync_parent(const std::string& filename)
+{
+  std::array<char, PATH_MAX> dir{'.'};
+  size_t slash{filename.rfind('/')};
+  if (slash == 0) dir[0] = '/';
+  else if (slash != std::string::npos and slash < dir.size()) filename.copy(dir.data(), slash);
+  else if (slash != std::string::npos) return;
+  int dfd{open(dir.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (dfd < 0) return;
+  int rc{fsync(dfd)};
+  close(dfd);
+  if (rc != 0)
+    throw std::runtime_error{std::string{"Sync failed: "} + std::strerror(errno)};
+}
+
+// Rename a file as fs::rename() does, building paths only to report
+// a failure.
+static void rename_file(const std::string& from, const std::string& to)
+{
+  if (::rename(from.c_str(), to.c_str()) != 0)
+    throw fs::filesystem_error{"cannot rename", fs::path{from}, fs::path{to}, std::error_code{errno, std::generic_category()}};
+}
+
+// Sync filesystem holding given file, unless it is among those synced.
+static void sync_filesystem(const std::string& filename, std::vector<dev_t>& synced)
+{
+  struct stat st{};
+  if (::stat(filename.c_str(), &st) != 0 or std::find(synced.begin(), synced.end(), st.st_dev) != synced.end()) return;
+  int fd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) return;
+  int rc{syncfs(fd)};
+  close(fd);
+  if (rc != 0)
+    throw std::runtime_error{std::string{"Sync failed: "} + std::strerror(errno)};
+  synced.emplace_back(st.st_dev);
+}
+
+// Replace original file with completed temporary file.
+void Krenq::commit_file(const std::string& tempname, const std::string& filename)
+{
+  if (m_durability == Krenq::Durability::none)
+  {
+    rename_file(tempname, filename);
+    return;
+  }
+  if (m_durability == Krenq::Durability::per_file)
+  {
+    rename_file(tempname, filename);
+    sync_parent(filename);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock{m_commitMutex};
+    // Rewriting a pending file went to the same temporary file, which
+    // is pending already.
+    auto last{m_pendingCommits.begin() + static_cast<std::ptrdiff_t>(m_pendingCount)};
+    auto pending{std::find_if(m_pendingCommits.begin(), last,
+      [&](const auto& commit){ return commit.first == tempname and commit.second == filename; })};
+    if (pending == last)
+    {
+      if (m_pendingCount == 0) m_batchStart = std::chrono::steady_clock::now();
+      // Paths are copied into room left by earlier batches if there is.
+      if (last == m_pendingCommits.end()) m_pendingCommits.emplace_back(tempname, filename);
+      else
+      {
+        last->first.assign(tempname);
+        last->second.assign(filename);
+      }
+      ++m_pendingCount;
+    }
+    if (m_pendingCount < m_batchFiles and
+      std::chrono::steady_clock::now() - m_batchStart < m_batchInterval) return;
+  }
+  this->flush_commits();
+}
+
+//
+// Move a completed chunk into chunk store. Chunks may show up in
+// store ahead of the files using them, and in batched mode they are
+// synced along with the batch.
+//
+void Krenq::commit_chunk(const std::string& tempname, const std::string& filename)
+{
+  rename_file(tempname, filename);
+  if (m_durability == Krenq::Durability::per_file) sync_parent(filename);
+}
+
+//
+// Commit pending batch. Data of all temporary files is synced first,
+// only then do they replace their originals, and the renames are
+// synced at last. Workers trying to commit meanwhile wait for it.
+//
+// A failed rename doesn't stop the others. The batch is dropped all
+// the same, its failed files left as temporary files and reported
+// once, after the renames done are synced.
+//
+void Krenq::flush_commits()
+{
+  std::lock_guard<std::mutex> lock{m_commitMutex};
+  if (m_pendingCount == 0) return;
+  m_syncedDevices.clear();
+  for (size_t i{}; i < m_pendingCount; ++i)
+    sync_filesystem(m_pendingCommits[i].first, m_syncedDevices);
+  // Chunks have to be durable before manifests naming them.
+  if (!m_dedupStore.empty()) sync_filesystem(m_dedupStore, m_syncedDevices);
+  // Renamed files are moved to the front, the first committed ones.
+  size_t committed{0};
+  std::string failed{};
+  for (size_t i{}; i < m_pendingCount; ++i)
+  {
+    try
+    {
+      rename_file(m_pendingCommits[i].first, m_pendingCommits[i].second);
+      std::swap(m_pendingCommits[committed++], m_pendingCommits[i]);
+    }
+    catch (const fs::filesystem_error& error)
+    {
+      failed += std::string{failed.empty() ? "" : "; "} + error.what();
+    }
+  }
+  m_pendingCount = 0;
+  m_syncedDevices.clear();
+  for (size_t i{}; i < committed; ++i)
+    sync_filesystem(m_pendingCommits[i].second, m_syncedDevices);
+  if (!failed.empty()) throw std::runtime_error{"Failed to commit: " + failed};
+}
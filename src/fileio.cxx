@@ -0,0 +1,150 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+// Output is written in extents of this size, aligned to file offset.
+static const size_t g_extentSize{1024 * 1024};
+// Written output is handed to writeback and dropped in windows of this size.
+static const std::uint64_t g_writebackWindow{8 * 1024 * 1024};
+
+//
+// Read up to n bytes at offset. Less than n is returned only at end
+// of file. The pages read are dropped from page cache right away, as
+// the data is never needed again and would only push out the page
+// cache of everyone else on the machine.
+//
+size_t Krenq::input_read(int fd, unsigned char* buf, size_t n, std::uint64_t offset)
+{
+  this->throttle_read(n);
+  size_t done{0};
+  while (done < n)
+  {
+    ssize_t r{pread(fd, buf + done, n - done, static_cast<off_t>(offset + done))};
+    if (r < 0 and errno == EINTR) continue;
+    if (r < 0) throw std::runtime_error{std::string{"Read failed: "} + std::strerror(errno)};
+    if (r == 0) break;
+    done += static_cast<size_t>(r);
+  }
+  posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(done), POSIX_FADV_DONTNEED);
+  return done;
+}
+
+//
+// Create output file, preallocated to its final size so that the
+// filesystem can lay it out in few extents instead of growing it
+// append by append. Writing starts at given offset. Output is
+// buffered in the arena of the calling thread, so a thread has a
+// single output file open at a time.
+//
+void Krenq::output_open(Krenq::OutputFile& out, const std::string& filename, std::uint64_t size, std::uint64_t offset)
+{
+  out.s_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (out.s_fd < 0)
+    throw std::runtime_error{"Failed to create " + filename + ": " + std::strerror(errno)};
+  // Not every filesystem can preallocate, which is fine.
+  if (size > 0) fallocate(out.s_fd, 0, 0, static_cast<off_t>(size));
+  out.s_offset = offset;
+  out.s_buf = this->arena_buffer(Krenq::ArenaSlot::output, g_extentSize);
+  out.s_used = 0;
+  out.s_written = 0;
+}
+
+// Buffer data, writing out every extent once it is complete.
+void Krenq::output_write(Krenq::OutputFile& out, const void* data, size_t n)
+{
+  auto* p{static_cast<const unsigned char*>(data)};
+  while (n > 0)
+  {
+    size_t room{g_extentSize - static_cast<size_t>((out.s_offset + out.s_used) % g_extentSize)};
+    size_t len{std::min(room, n)};
+    std::memcpy(out.s_buf + out.s_used, p, len);
+    out.s_used += len;
+    p += len;
+    n -= len;
+    if (len == room) this->output_flush(out);
+  }
+}
+
+//
+// Write buffered data out.
+//
+// Every full window of written data is handed to writeback at once,
+// and the window before it, which had a window's time to reach the
+// disk, is dropped from page cache. This keeps a bulk run from
+// filling page cache with dirty data nobody is going to read.
+//
+void Krenq::output_flush(Krenq::OutputFile& out)
+{
+  if (out.s_used == 0) return;
+  this->throttle_write(out.s_used);
+  size_t done{0};
+  while (done < out.s_used)
+  {
+    ssize_t w{pwrite(out.s_fd, out.s_buf + done, out.s_used - done, static_cast<off_t>(out.s_offset + done))};
+    if (w < 0 and errno == EINTR) continue;
+    if (w < 0) throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+    done += static_cast<size_t>(w);
+  }
+  out.s_offset += out.s_used;
+  out.s_used = 0;
+  while (out.s_offset - out.s_written >= g_writebackWindow)
+  {
+    sync_file_range(out.s_fd, static_cast<off_t>(out.s_written), g_writebackWindow, SYNC_FILE_RANGE_WRITE);
+    if (out.s_written >= g_writebackWindow)
+    {
+      off_t previous{static_cast<off_t>(out.s_written - g_writebackWindow)};
+      sync_file_range(out.s_fd, previous, g_writebackWindow, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(out.s_fd, previous, g_writebackWindow, POSIX_FADV_DONTNEED);
+    }
+    out.s_written += g_writebackWindow;
+  }
+}
+
+//
+// Move on to given offset, ahead of where writing is, leaving a hole
+// in between. Writeback carries on from the window holding offset.
+//
+void Krenq::output_seek(Krenq::OutputFile& out, std::uint64_t offset)
+{
+  if (out.s_offset + out.s_used == offset) return;
+  this->output_flush(out);
+  out.s_offset = offset;
+  if (offset - out.s_written >= g_writebackWindow) out.s_written = offset - offset % g_writebackWindow;
+}
+
+// Flush remaining data, write the header at the start and close.
+void Krenq::output_close(Krenq::OutputFile& out, const std::string& header)
+{
+  this->output_flush(out);
+  if (!header.empty())
+  {
+    this->throttle_write(header.size());
+    if (pwrite(out.s_fd, header.data(), header.size(), 0) != static_cast<ssize_t>(header.size()))
+      throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+  }
+  this->sync_output(out.s_fd);
+  int fd{out.s_fd};
+  out.s_fd = -1;
+  if (close(fd) != 0)
+    throw std::runtime_error{std::string{"Write failed: "} + std::strerror(errno)};
+}
+
+// Close and remove an output file which could not be completed.
+void Krenq::output_abort(Krenq::OutputFile& out, const std::string& filename)
+{
+  if (out.s_fd < 0) return;
+  close(out.s_fd);
+  out.s_fd = -1;
+  unlink(filename.c_str());
+}
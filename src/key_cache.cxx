@@ -0,0 +1,60 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Holds the length of actual key.
+static const size_t g_actualKlen{154};
+// Number of keys XOR'ed by a tile in one go. One more key is kept
+// after them so that a run can start at any phase.
+static const size_t g_tileBlocks{64};
+// Number of keys kept by every shard of key cache.
+static const size_t g_keysPerShard{8};
+
+// Expand key into a tile. Encrypted key names the key in files.
+std::shared_ptr<const Krenq::KeyTile> Krenq::expand_key(const std::string& key, const std::string& encryptedKey)
+{
+  auto tile{std::make_shared<Krenq::KeyTile>()};
+  tile->s_key = key;
+  tile->s_keyHash = this->get_string_hash(encryptedKey);
+  tile->s_tile.resize((g_tileBlocks + 1) * g_actualKlen);
+  for (size_t i{}; i < tile->s_tile.size(); ++i)
+    tile->s_tile[i] = static_cast<unsigned char>(key[i % g_actualKlen]);
+  return tile;
+}
+
+// Look up a key by hash of its key file. Found key becomes most recent.
+std::shared_ptr<const Krenq::KeyTile> Krenq::find_key(const std::string& id)
+{
+  auto& shard{m_keyCache.s_shards[static_cast<unsigned char>(id[0]) % m_keyCache.s_shards.size()]};
+  std::lock_guard<std::mutex> lock{shard.s_mutex};
+  auto iter{shard.s_index.find(id)};
+  if (iter == shard.s_index.end()) return {};
+  shard.s_lru.splice(shard.s_lru.end(), shard.s_lru, iter->second);
+  return iter->second->second;
+}
+
+//
+// Keep a key by hash of its key file, dropping the least recently
+// used key of the shard when it's full. Tiles handed out before stay
+// valid for as long as they are held.
+//
+void Krenq::cache_key(const std::string& id, const std::shared_ptr<const Krenq::KeyTile>& key)
+{
+  auto& shard{m_keyCache.s_shards[static_cast<unsigned char>(id[0]) % m_keyCache.s_shards.size()]};
+  std::lock_guard<std::mutex> lock{shard.s_mutex};
+  if (shard.s_index.contains(id)) return;
+  if (shard.s_lru.size() == g_keysPerShard)
+  {
+    shard.s_index.erase(shard.s_lru.front().first);
+    shard.s_lru.pop_front();
+  }
+  shard.s_lru.emplace_back(id, key);
+  shard.s_index[id] = std::prev(shard.s_lru.end());
+}
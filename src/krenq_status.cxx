@@ -5,13 +5,14 @@
  * See the LICENSE file for more information.
  */
 #include "krenq/Core.hxx"
-#include <algorithm>
 #include <array>
-#include <fstream>
-#include <ios>
+#include <cstdint>
+#include <cstring>
 #include <string>
-#include <tuple>
-#include <utility>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Number of elements in each pattern.
 static constexpr int g_plen{12};
@@ -23,6 +24,29 @@ static constexpr std::array<unsigned char, g_plen> g_middleMarkers
   0x1f, 0x00, 0x05, 0x0c, 0x0d, 0x11,
   0x1e, 0x1c, 0x15, 0x10, 0x0b, 0x04
 };
+// Middle marker bytes of chunked files. None of them is a classic
+// marker, so older versions take chunked files for plain ones and
+// leave them alone instead of decrypting them wrong.
+static constexpr std::array<unsigned char, g_plen> g_chunkedMarkers
+{
+  0x06, 0x07, 0x08, 0x0e, 0x0f, 0x12,
+  0x13, 0x14, 0x16, 0x17, 0x18, 0x19
+};
+// Middle marker bytes of deduplicated files, none of them classic
+// or chunked either.
+static constexpr std::array<unsigned char, g_plen> g_manifestMarkers
+{
+  0x01, 0x02, 0x03, 0x09, 0x0a, 0x1a,
+  0x1b, 0x1d, 0x7f, 0x80, 0x81, 0x82
+};
+// Smallest possible classic encrypted file: header, one block and trailer.
+static const size_t g_minClassicSize{32 + 12 + 1 + 12 + 154 + 32};
+// Smallest possible chunked encrypted file: header, chunk header,
+// a single hash, a single byte and trailer.
+static const size_t g_minChunkedSize{32 + 12 + 1 + 12 + 36 + 32 + 1 + 32};
+// Smallest possible deduplicated file: header, manifest header, a
+// single entry and trailer. No encrypted file is smaller.
+static const size_t g_minManifestSize{32 + 12 + 1 + 12 + 24 + 36 + 32};
 
 // Possible patterns.
 static constexpr std::array<unsigned char, g_plen> pattern0
@@ -239,72 +263,138 @@ static constexpr std::array<std::array<unsigned char, g_plen>, g_numberOfPattern
   pattern35, pattern36, pattern37, pattern38, pattern39
 };
 
-// Generates the krenq-status of a file.
-// Encryption status.
-// Prefix pattern, suffix pattern, middle marker.
-// File size.
-// File key hash.
-void Krenq::krenq_status(const std::string& filename, Krenq::type_estatus& estatus)
-{
-  estatus = {false, {-1, -1, -1}, 0, {}};
-  std::fstream ifile{filename, std::ios::in | std::ios::binary};
-  ifile.seekg(0, std::ios::end);
-  size_t filesize{static_cast<size_t>(ifile.tellg())};
-  std::get<2>(estatus) = filesize;
-  // Minimum encrypted file size is 243 bytes so if smaller, you
+// Patterns are found through a perfect hash, worked out at compile
+// time: the first multiplier that sends every pattern to its own slot.
+static constexpr int g_patternBits{8};
+static constexpr size_t g_patternSlots{size_t{1} << g_patternBits};
+
+// Hash of the pattern at p with multiplier mult.
+static constexpr size_t pattern_hash(const unsigned char* p, std::uint64_t mult)
+{
+  std::uint64_t low{};
+  std::uint64_t high{};
+  for (int i{}; i < 8; ++i) low |= std::uint64_t{p[i]} << (8 * i);
+  for (int i{8}; i < g_plen; ++i) high |= std::uint64_t{p[i]} << (8 * (i - 8));
+  return ((low ^ (high * 0x9e3779b97f4a7c15ULL)) * mult) >> (64 - g_patternBits);
+}
+
+// First odd multiplier under which no two patterns collide.
+static constexpr std::uint64_t find_multiplier()
+{
+  for (std::uint64_t mult{0xff51afd7ed558ccdULL};; mult += 0x2545f4914f6cdd1cULL)
+  {
+    std::array<bool, g_patternSlots> used{};
+    bool perfect{true};
+    for (auto& pattern : patterns)
+    {
+      size_t slot{pattern_hash(pattern.data(), mult)};
+      if (used[slot])
+      {
+        perfect = false;
+        break;
+      }
+      used[slot] = true;
+    }
+    if (perfect) return mult;
+  }
+}
+static constexpr std::uint64_t g_patternMultiplier{find_multiplier()};
+
+// Pattern index of every slot, -1 for empty ones.
+static constexpr std::array<signed char, g_patternSlots> make_pattern_table()
+{
+  std::array<signed char, g_patternSlots> table{};
+  table.fill(-1);
+  for (size_t i{}; i < patterns.size(); ++i)
+    table[pattern_hash(patterns[i].data(), g_patternMultiplier)] = static_cast<signed char>(i);
+  return table;
+}
+static constexpr std::array<signed char, g_patternSlots> g_patternTable{make_pattern_table()};
+
+// Marker index of every byte, -1 for bytes that are no marker. Markers
+// of chunked files come after classic ones, those of deduplicated
+// files last.
+static constexpr std::array<signed char, 256> make_marker_table()
+{
+  std::array<signed char, 256> table{};
+  table.fill(-1);
+  for (int i{}; i < g_plen; ++i)
+  {
+    table[g_middleMarkers[i]] = static_cast<signed char>(i);
+    table[g_chunkedMarkers[i]] = static_cast<signed char>(g_plen + i);
+    table[g_manifestMarkers[i]] = static_cast<signed char>(2 * g_plen + i);
+  }
+  return table;
+}
+static constexpr std::array<signed char, 256> g_markerTable{make_marker_table()};
+
+// Return index of the pattern at p, -1 if it is none.
+static short find_pattern(const unsigned char* p)
+{
+  signed char index{g_patternTable[pattern_hash(p, g_patternMultiplier)]};
+  if (index < 0 or std::memcmp(patterns[index].data(), p, g_plen) != 0) return -1;
+  return index;
+}
+
+// Generates the krenq-status of a file from a single read of its
+// header and one of its trailer.
+Krenq::EStatus Krenq::krenq_status(const std::string& filename)
+{
+  static_assert(std::is_trivially_copyable_v<Krenq::EStatus>);
+  Krenq::EStatus estatus{};
+  int fd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) return estatus;
+  struct stat st{};
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return estatus;
+  }
+  estatus.s_size = static_cast<std::uint64_t>(st.st_size);
+  // Minimum encrypted file size is 149 bytes so if smaller, you
   // know what to do.
-  if (filesize < 32 + 12 + 1 + 12 + 154 + 32)
+  std::array<unsigned char, 32 + 2 * g_plen + 1> header{};
+  if (estatus.s_size < g_minManifestSize or
+    pread(fd, header.data(), header.size(), 0) != static_cast<ssize_t>(header.size()))
   {
-    ifile.close();
-    return;
+    close(fd);
+    return estatus;
   }
 
-  std::array<unsigned char, 12> buffer{};
-  ifile.seekg(0 + 32, std::ios::beg);
-  ifile.read(reinterpret_cast<char*>(buffer.data()), 12);
-  auto iter{std::find(patterns.begin(), patterns.end(), buffer)};
-  if (iter == patterns.end())
+  estatus.s_prefix = find_pattern(header.data() + 32);
+  if (estatus.s_prefix == -1)
   {
-    ifile.close();
-    return;
+    close(fd);
+    return estatus;
   }
-  std::get<0>(std::get<1>(estatus)) = (iter - patterns.begin());
-  
-  ifile.seekg(0+ 32 + 12, std::ios::beg);
-  char marker{};
-  ifile.get(marker);
-  auto iter2{std::find(g_middleMarkers.begin(), g_middleMarkers.end(), marker)};
-  if (iter2 == g_middleMarkers.end())
+
+  short marker{g_markerTable[header[32 + g_plen]]};
+  if ((marker < g_plen and estatus.s_size < g_minClassicSize) or
+    (marker >= g_plen and marker < 2 * g_plen and estatus.s_size < g_minChunkedSize))
+    marker = -1;
+  if (marker == -1)
   {
-    ifile.close();
-    return;
+    close(fd);
+    return estatus;
   }
-  std::get<2>(std::get<1>(estatus)) = iter2 - g_middleMarkers.begin();
-  
-  std::array<unsigned char, 12> buffer2{};
-  ifile.seekg(0+ 32 + 12 + 1, std::ios::beg);
-  ifile.read(reinterpret_cast<char*>(buffer2.data()), 12);
-  auto iter3{std::find(patterns.begin(), patterns.end(), buffer2)};
-  if (iter3 == patterns.end())
+  estatus.s_marker = marker;
+
+  estatus.s_suffix = find_pattern(header.data() + 32 + g_plen + 1);
+  if (estatus.s_suffix == -1)
   {
-    ifile.close();
-    return;
+    close(fd);
+    return estatus;
   }
-  std::get<1>(std::get<1>(estatus)) = iter3 - patterns.begin();
-  std::get<0>(estatus) = true;
-  std::array<unsigned char, 32> buffer3{};
-  ifile.seekg(filesize - 32, std::ios::beg);
-  ifile.read(reinterpret_cast<char*>(buffer3.data()), 32);
-  std::string keyhash{};
-  for (unsigned char c : buffer3) keyhash += c;
-  std::get<3>(estatus) = keyhash;
-  ifile.close();
+  estatus.s_encrypted = pread(fd, estatus.s_keyHash.data(), estatus.s_keyHash.size(),
+    static_cast<off_t>(estatus.s_size - estatus.s_keyHash.size())) == static_cast<ssize_t>(estatus.s_keyHash.size());
+  close(fd);
+  return estatus;
 }
 
 // Generate random prefix and optionally selected ones.
 void Krenq::make_prefix(std::string& prefix, short i1, short i2, short i3)
 {
-  prefix = {};
+  prefix.clear();
   prefix.reserve(2 * pattern0.size() + 1);
   short index1{static_cast<short>(this->get_randomN_from_limit(0, g_numberOfPatterns - 1))};
   short index2{static_cast<short>(this->get_randomN_from_limit(0, g_numberOfPatterns - 1))};
@@ -320,4 +410,30 @@ void Krenq::make_prefix(std::string& prefix, short i1, short i2, short i3)
   for (auto c : patterns[index2]) prefix += c;
 }
 
+// Generate random prefix of a chunked file.
+void Krenq::make_chunked_prefix(std::string& prefix)
+{
+  this->make_prefix(prefix);
+  prefix[g_plen] = g_chunkedMarkers[this->get_randomN_from_limit(0, g_plen - 1)];
+}
+
+// Generate random prefix of a deduplicated file.
+void Krenq::make_manifest_prefix(std::string& prefix)
+{
+  this->make_prefix(prefix);
+  prefix[g_plen] = g_manifestMarkers[this->get_randomN_from_limit(0, g_plen - 1)];
+}
+
+// Return true if status is of a chunked file.
+bool Krenq::is_chunked(const Krenq::EStatus& estatus)
+{
+  return estatus.s_encrypted and estatus.s_marker >= g_plen and estatus.s_marker < 2 * g_plen;
+}
+
+// Return true if status is of a deduplicated file.
+bool Krenq::is_manifest(const Krenq::EStatus& estatus)
+{
+  return estatus.s_encrypted and estatus.s_marker >= 2 * g_plen;
+}
+
 
@@ -0,0 +1,252 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Holds the length of actual key.
+static const size_t g_actualKlen{154};
+// Size of header: plain file hash, pattern, marker, pattern.
+static const size_t g_headerSize{32 + 12 + 1 + 12};
+// Size of trailer: encrypted key hash.
+static const size_t g_keyHashSize{32};
+// Number of key-sized blocks read at once, about a MiB.
+static const size_t g_ioBlocks{6808};
+// Largest chunk of a deduplicated file.
+static const size_t g_maxCut{256 * 1024};
+
+//
+// Map memory for length bytes of plain data, kept out of core dumps
+// and, if asked, locked so it never goes to swap. Throws if it can't
+// be locked.
+//
+Krenq::PlainBuffer::PlainBuffer(std::uint64_t length, bool locked)
+  : s_length{length}
+{
+  long page{sysconf(_SC_PAGESIZE)};
+  s_mapped = static_cast<size_t>((std::max<std::uint64_t>(length, 1) + page - 1) / page * page);
+  void* p{mmap(nullptr, s_mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)};
+  if (p == MAP_FAILED) throw std::runtime_error{"Out of memory for plain data!"};
+  s_data = static_cast<unsigned char*>(p);
+  madvise(s_data, s_mapped, MADV_DONTDUMP);
+  if (locked and mlock(s_data, s_mapped) != 0)
+  {
+    munmap(s_data, s_mapped);
+    throw std::runtime_error{"Cannot lock plain data in memory: " + std::string{std::strerror(errno)} + "!"};
+  }
+}
+
+// Wipe plain data before giving its memory back.
+Krenq::PlainBuffer::~PlainBuffer()
+{
+  explicit_bzero(s_data, s_mapped);
+  munmap(s_data, s_mapped);
+}
+
+//
+// Set byte budget of plain cache and whether its memory is locked.
+// Files are dropped, least recently used first, until the rest fit.
+// Files already cached keep the memory they were given.
+//
+void Krenq::set_plain_cache(std::uint64_t bytes, bool locked)
+{
+  std::lock_guard<std::mutex> lock{m_plainCache.s_mutex};
+  m_plainCache.s_budget = bytes;
+  m_plainCache.s_locked = locked;
+  while (m_plainCache.s_bytes > m_plainCache.s_budget)
+  {
+    m_plainCache.s_bytes -= m_plainCache.s_lru.front().s_buffer->s_length;
+    m_plainCache.s_index.erase(m_plainCache.s_lru.front().s_id);
+    m_plainCache.s_lru.pop_front();
+  }
+}
+
+//
+// Decrypt a whole encrypted file into memory of its own, checked
+// against the hash of its plain data, or against its tree if it's
+// chunked. Throws if it doesn't match or can't be read.
+//
+std::shared_ptr<Krenq::PlainBuffer> Krenq::load_plain(const std::string& filename, const Krenq::EStatus& estatus, const Krenq::KeyTile& key)
+{
+  bool locked{};
+  {
+    std::lock_guard<std::mutex> lock{m_plainCache.s_mutex};
+    locked = m_plainCache.s_locked;
+  }
+  std::shared_ptr<Krenq::PlainBuffer> plain{};
+  if (this->is_chunked(estatus))
+  {
+    this->read_chunked(filename, estatus, key, 0, UINT64_MAX, [&](std::uint64_t size)
+    {
+      plain = std::make_shared<Krenq::PlainBuffer>(size, locked);
+      return plain->s_data;
+    });
+    if (!plain) plain = std::make_shared<Krenq::PlainBuffer>(0, locked);
+    return plain;
+  }
+
+  std::array<std::uint8_t, 32> fullHash{};
+  std::array<std::uint8_t, 32> legacyHash{};
+  struct Sha_256 full;
+  struct Sha_256 legacy;
+  sha_256_init(&full, fullHash.data());
+  sha_256_init(&legacy, legacyHash.data());
+  std::string stored{};
+  if (this->is_manifest(estatus))
+  {
+    std::vector<Krenq::ManifestEntry> entries{};
+    if (!this->read_manifest(filename, estatus.s_size, key, stored, entries))
+      throw std::runtime_error{"Broken manifest in " + filename + "!"};
+    std::uint64_t plainsize{};
+    for (auto& entry : entries) plainsize += entry.s_length;
+    plain = std::make_shared<Krenq::PlainBuffer>(plainsize, locked);
+    unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, 2 * g_maxCut)};
+    std::uint64_t offset{};
+    try
+    {
+      for (auto& entry : entries)
+      {
+        this->load_chunk(entry, key, fbuf);
+        std::memcpy(plain->s_data + offset, fbuf, entry.s_length);
+        offset += entry.s_length;
+      }
+    }
+    catch (...)
+    {
+      explicit_bzero(fbuf, 2 * g_maxCut);
+      throw;
+    }
+    explicit_bzero(fbuf, 2 * g_maxCut);
+    sha_256_write(&full, plain->s_data, plain->s_length);
+    sha_256_close(&full);
+    if (stored != std::string{fullHash.begin(), fullHash.end()})
+      throw std::runtime_error{filename + " failed verification!"};
+    return plain;
+  }
+
+  // Files written by older versions hash plain data only up to its
+  // first null byte, so either hash matching is fine.
+  std::uint64_t bodysize{estatus.s_size - g_headerSize - g_keyHashSize};
+  if (bodysize % g_actualKlen != 0) throw std::runtime_error{filename + " failed verification!"};
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) throw std::runtime_error{"Failed to read " + filename};
+  try
+  {
+    stored.resize(32);
+    std::array<unsigned char, g_actualKlen> last{};
+    if (pread(ifd, stored.data(), stored.size(), 0) != static_cast<ssize_t>(stored.size()) or
+      pread(ifd, last.data(), g_actualKlen, g_headerSize + bodysize - g_actualKlen) != static_cast<ssize_t>(g_actualKlen))
+      throw std::runtime_error{"Failed to read " + filename};
+    this->apply_key(last.data(), g_actualKlen, 0, key);
+    std::uint64_t plainsize{bodysize - this->remove_padding(last.data())};
+    explicit_bzero(last.data(), last.size());
+    plain = std::make_shared<Krenq::PlainBuffer>(plainsize, locked);
+    for (std::uint64_t offset{}; offset < plainsize;)
+    {
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(g_ioBlocks * g_actualKlen, plainsize - offset))};
+      if (this->input_read(ifd, plain->s_data + offset, n, g_headerSize + offset) != n)
+        throw std::runtime_error{"File shrank while being read: " + filename};
+      this->apply_key(plain->s_data + offset, n, offset, key);
+      offset += n;
+    }
+  }
+  catch (...)
+  {
+    close(ifd);
+    throw;
+  }
+  close(ifd);
+  sha_256_write(&full, plain->s_data, plain->s_length);
+  sha_256_close(&full);
+  auto* nul{static_cast<unsigned char*>(std::memchr(plain->s_data, 0, plain->s_length))};
+  sha_256_write(&legacy, plain->s_data, nul ? nul - plain->s_data : plain->s_length);
+  sha_256_close(&legacy);
+  if (stored != std::string{fullHash.begin(), fullHash.end()} and stored != std::string{legacyHash.begin(), legacyHash.end()})
+    throw std::runtime_error{filename + " failed verification!"};
+  return plain;
+}
+
+//
+// Read all plain data of an encrypted file. Files are cached by path
+// and keyhash, along with device, inode, size, modification and
+// change time of the encrypted file. Any of them changing, as it does
+// when the file is written or replaced, drops the cached data and
+// the file is read again. Data handed out stays valid after being
+// dropped, for as long as it is held.
+//
+Krenq::PlainFile Krenq::read_file(const std::string& filename, const std::string& keyname)
+{
+  std::shared_ptr<const Krenq::KeyTile> key{this->extract_key(keyname)};
+  std::string id{filename};
+  id += '\0';
+  id += key->s_keyHash;
+  // Entry of the file as it is now, without id if it's gone.
+  auto look{[&]
+  {
+    struct stat st{};
+    if (stat(filename.c_str(), &st) != 0) return Krenq::PlainCache::Entry{};
+    return Krenq::PlainCache::Entry{id, st.st_dev, st.st_ino, static_cast<std::uint64_t>(st.st_size),
+      st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec, st.st_ctim.tv_sec * 1'000'000'000LL + st.st_ctim.tv_nsec, {}};
+  }};
+  Krenq::PlainCache::Entry entry{look()};
+  if (entry.s_id.empty()) throw std::runtime_error{"Failed to read " + filename};
+  auto same{[&](const Krenq::PlainCache::Entry& other)
+  {
+    return other.s_dev == entry.s_dev and other.s_ino == entry.s_ino and other.s_size == entry.s_size and
+      other.s_mtime == entry.s_mtime and other.s_ctime == entry.s_ctime;
+  }};
+  {
+    std::lock_guard<std::mutex> lock{m_plainCache.s_mutex};
+    auto iter{m_plainCache.s_index.find(id)};
+    if (iter != m_plainCache.s_index.end())
+    {
+      if (same(*iter->second))
+      {
+        m_plainCache.s_lru.splice(m_plainCache.s_lru.end(), m_plainCache.s_lru, iter->second);
+        auto buffer{iter->second->s_buffer};
+        return {buffer, {reinterpret_cast<const char*>(buffer->s_data), static_cast<size_t>(buffer->s_length)}};
+      }
+      m_plainCache.s_bytes -= iter->second->s_buffer->s_length;
+      m_plainCache.s_lru.erase(iter->second);
+      m_plainCache.s_index.erase(iter);
+    }
+  }
+
+  Krenq::EStatus estatus{this->krenq_status(filename)};
+  if (!estatus.s_encrypted or estatus.key_hash() != key->s_keyHash)
+    throw std::runtime_error{filename + " is not encrypted with " + keyname + "!"};
+  std::shared_ptr<const Krenq::PlainBuffer> buffer{this->load_plain(filename, estatus, *key)};
+  Krenq::PlainFile plain{buffer, {reinterpret_cast<const char*>(buffer->s_data), static_cast<size_t>(buffer->s_length)}};
+
+  // Cache it only if the file stayed the same while being read.
+  Krenq::PlainCache::Entry now{look()};
+  if (now.s_id.empty() or !same(now)) return plain;
+  entry.s_buffer = buffer;
+  std::lock_guard<std::mutex> lock{m_plainCache.s_mutex};
+  if (buffer->s_length > m_plainCache.s_budget or m_plainCache.s_index.contains(id)) return plain;
+  while (m_plainCache.s_bytes + buffer->s_length > m_plainCache.s_budget)
+  {
+    m_plainCache.s_bytes -= m_plainCache.s_lru.front().s_buffer->s_length;
+    m_plainCache.s_index.erase(m_plainCache.s_lru.front().s_id);
+    m_plainCache.s_lru.pop_front();
+  }
+  m_plainCache.s_bytes += buffer->s_length;
+  m_plainCache.s_lru.emplace_back(std::move(entry));
+  m_plainCache.s_index[id] = std::prev(m_plainCache.s_lru.end());
+  return plain;
+}
@@ -5,6 +5,7 @@
  * See the LICENSE file for more information.
  */
 #include "krenq/Core.hxx"
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <cstdint>
@@ -12,8 +13,8 @@
 #include <fstream>
 #include <iomanip>
 #include <ios>
-#include <random>
 #include <sstream>
+#include <utility>
 
 // Return string hash.
 std::string Krenq::get_string_hash(const std::string& strn)
@@ -29,25 +30,6 @@ std::string Krenq::get_string_hash(const std::string& strn)
   return sha256HashString;
 }
 
-// Return file hash.
-std::string Krenq::get_file_hash(const std::string& filename)
-{
-  std::fstream ifile{filename, std::ios::in | std::ios::binary};
-  std::stringstream iss;
-  iss << ifile.rdbuf();
-  std::string filedata{iss.str()};
-  struct Sha_256 sha_256;
-  std::array<std::uint8_t, 32> sha256Hash{};
-  sha_256_init(&sha_256, sha256Hash.data());
-  sha_256_write(&sha_256, filedata.c_str(), std::strlen(filedata.c_str()));
-  sha_256_close(&sha_256);
-  std::string sha256HashString{};
-  sha256HashString.reserve(32);
-  for (auto e : sha256Hash) sha256HashString += e;
-  ifile.close();
-  return sha256HashString;
-}
-
 // Return random string of specified null-terminated string and
 // optionally using bytes from specified string.
 std::string Krenq::get_random_string(size_t len, const std::string& providedCharDB)
@@ -56,24 +38,40 @@ std::string Krenq::get_random_string(size_t len, const std::string& providedChar
   std::string charDB{"(D}He{nw<pJA_|Lkcb1d?IfWV2Pym;0%*qNQ\\Gv8u4Bt]l[T$CiSa,zXh'rK6/!O5>=)3YxjZ7+@&sg.R-FU^:M#E9o\""};
   if (providedCharDB.length() != 0) charDB = providedCharDB;
 
-  /** Generate random string of length `len`. */
+  /**
+   * Generate random string of length `len`, from random bytes taken in
+   * bulk. Bytes past the last whole multiple of the database length
+   * are dropped so every character is as likely.
+   */
   std::string random_string{};
   random_string.reserve(len);
-  for (size_t i{}; i < len - 1; ++i)
+  size_t dblen{std::min<size_t>(charDB.length(), 256)};
+  unsigned limit{256 - 256 % static_cast<unsigned>(dblen)};
+  std::array<unsigned char, 64> bytes{};
+  while (random_string.length() + 1 < len)
   {
-    random_string += charDB[this->get_randomN_from_limit(0, charDB.length() - 1)];
+    Krenq::fill_random(bytes.data(), bytes.size());
+    for (size_t i{}; i < bytes.size() and random_string.length() + 1 < len; ++i)
+      if (bytes[i] < limit) random_string += charDB[bytes[i] % dblen];
   }
   return random_string;
 }
 
-// Return random number within limit.
+// Return random number within limit. Draws past the last whole
+// multiple of the span are dropped so every number is as likely.
 long long Krenq::get_randomN_from_limit(long long u, long long v)
 {
   if (u > v) std::swap(u, v);
-  std::random_device rd;
-  std::mt19937 gen{rd()};
-  std::uniform_int_distribution<> dist(u, v);
-  return dist(gen);
+  std::uint64_t span{static_cast<std::uint64_t>(v) - static_cast<std::uint64_t>(u) + 1};
+  std::uint64_t draw{};
+  if (span == 0)
+  {
+    Krenq::fill_random(&draw, sizeof(draw));
+    return static_cast<long long>(draw);
+  }
+  std::uint64_t limit{UINT64_MAX - UINT64_MAX % span};
+  do Krenq::fill_random(&draw, sizeof(draw)); while (draw >= limit);
+  return static_cast<long long>(static_cast<std::uint64_t>(u) + draw % span);
 }
 
 // Return little-endian format of 32-bit uint.
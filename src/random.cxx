@@ -0,0 +1,139 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <pthread.h>
+#include <sys/random.h>
+
+// ChaCha20 blocks made per refill of a thread's buffer.
+static constexpr size_t g_randomBlocks{16};
+// Bytes served before a thread's generator is seeded again from the
+// system.
+static constexpr std::uint64_t g_reseedBytes{1024 * 1024};
+
+//
+// Random bytes of a thread. Every refill makes a batch of ChaCha20
+// blocks, takes its first 32 bytes as the next ChaCha20 key and
+// serves the rest, wiping every byte once served. Bytes already
+// served can then not be worked out from what is left in memory.
+//
+struct RandomPool
+{
+  std::array<std::uint32_t, 8> s_key{};
+  std::array<unsigned char, 64 * g_randomBlocks> s_buffer{};
+  size_t s_position{64 * g_randomBlocks};
+  std::uint64_t s_served{g_reseedBytes};
+};
+static thread_local RandomPool g_pool{};
+
+// A forked child would serve the same bytes as its parent, so it drops
+// what it was left with. Only the forking thread lives on in the child.
+static const int g_forkHandler{pthread_atfork(nullptr, nullptr, []
+{
+  g_pool = RandomPool{};
+})};
+
+static constexpr std::uint32_t rotl(std::uint32_t v, int c)
+{
+  return (v << c) | (v >> (32 - c));
+}
+
+static constexpr void quarter_round(std::array<std::uint32_t, 16>& x, int a, int b, int c, int d)
+{
+  x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+  x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+  x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+  x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+}
+
+// Write ChaCha20 block number counter of key to out, with a zero nonce.
+static void chacha20_block(const std::array<std::uint32_t, 8>& key, std::uint32_t counter, unsigned char* out)
+{
+  std::array<std::uint32_t, 16> state
+  {
+    0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+    key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+    counter, 0, 0, 0
+  };
+  std::array<std::uint32_t, 16> x{state};
+  for (int i{}; i < 10; ++i)
+  {
+    quarter_round(x, 0, 4, 8, 12);
+    quarter_round(x, 1, 5, 9, 13);
+    quarter_round(x, 2, 6, 10, 14);
+    quarter_round(x, 3, 7, 11, 15);
+    quarter_round(x, 0, 5, 10, 15);
+    quarter_round(x, 1, 6, 11, 12);
+    quarter_round(x, 2, 7, 8, 13);
+    quarter_round(x, 3, 4, 9, 14);
+  }
+  for (int i{}; i < 16; ++i)
+  {
+    std::uint32_t word{x[i] + state[i]};
+    out[4 * i] = static_cast<unsigned char>(word);
+    out[4 * i + 1] = static_cast<unsigned char>(word >> 8);
+    out[4 * i + 2] = static_cast<unsigned char>(word >> 16);
+    out[4 * i + 3] = static_cast<unsigned char>(word >> 24);
+  }
+}
+
+// Fill out with len bytes of system entropy.
+static void system_random(void* out, size_t len)
+{
+  unsigned char* p{static_cast<unsigned char*>(out)};
+  while (len > 0)
+  {
+    ssize_t got{getrandom(p, len, 0)};
+    if (got < 0)
+    {
+      if (errno == EINTR) continue;
+      throw std::runtime_error{"Cannot read system entropy!"};
+    }
+    p += got;
+    len -= static_cast<size_t>(got);
+  }
+}
+
+// Make a fresh batch of random bytes, seeding the generator from the
+// system first if it served enough.
+static void refill(RandomPool& pool)
+{
+  if (pool.s_served >= g_reseedBytes)
+  {
+    system_random(pool.s_key.data(), sizeof(pool.s_key));
+    pool.s_served = 0;
+  }
+  for (size_t i{}; i < g_randomBlocks; ++i)
+    chacha20_block(pool.s_key, static_cast<std::uint32_t>(i), pool.s_buffer.data() + 64 * i);
+  std::memcpy(pool.s_key.data(), pool.s_buffer.data(), sizeof(pool.s_key));
+  std::memset(pool.s_buffer.data(), 0, sizeof(pool.s_key));
+  pool.s_position = sizeof(pool.s_key);
+}
+
+// Fill out with len random bytes from the generator of the calling
+// thread.
+void Krenq::fill_random(void* out, size_t len)
+{
+  RandomPool& pool{g_pool};
+  unsigned char* p{static_cast<unsigned char*>(out)};
+  while (len > 0)
+  {
+    if (pool.s_position == pool.s_buffer.size()) refill(pool);
+    size_t n{std::min(len, pool.s_buffer.size() - pool.s_position)};
+    std::memcpy(p, pool.s_buffer.data() + pool.s_position, n);
+    std::memset(pool.s_buffer.data() + pool.s_position, 0, n);
+    pool.s_position += n;
+    pool.s_served += n;
+    p += n;
+    len -= n;
+  }
+}
@@ -31,14 +31,9 @@ namespace fs = std::filesystem;
 // doesn't, we can proceed. And if it does, we should throw an
 // exception and terminate the program hehe.
 //
-void Krenq::save_key(const std::string& keyname)
+std::string Krenq::key_filename(const std::string& keyname)
 {
-  if (m_keyIsSaved == true)
-  {
-    std::cout << "Copies of same key cannot be generated even in different files!";
-    return;
-  }
-  if (keyname[0] == '.') throw std::runtime_error{"Keys cannot be generated hiddenly!"};
+  if (keyname.empty() or keyname[0] == '.') throw std::runtime_error{"Keys cannot be generated hiddenly!"};
   std::string mainKey{};
   if (keyname.length() <= 6) mainKey = keyname + ".krenq";
   else if (keyname.length() > 6)
@@ -47,7 +42,18 @@ void Krenq::save_key(const std::string& keyname)
     if (ext == ".krenq") mainKey = keyname;
     else mainKey = keyname + ".krenq";
   }
+  return mainKey;
+}
 
+// Saves generated key under valid keyname, once.
+void Krenq::save_key(const std::string& keyname)
+{
+  if (m_keyIsSaved == true)
+  {
+    std::cout << "Copies of same key cannot be generated even in different files!";
+    return;
+  }
+  std::string mainKey{this->key_filename(keyname)};
   fs::path p{mainKey};
   if (fs::exists(p)) throw std::runtime_error{"Key already exists! Choose a unique name!"};
   m_keyname = mainKey;
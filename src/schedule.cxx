@@ -0,0 +1,250 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <string>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <vector>
+
+// Files up to this size are batched together.
+static const std::uint64_t g_smallFile{256 * 1024};
+// Batches of small files are closed around this weight.
+static const std::uint64_t g_batchWeight{8 * 1024 * 1024};
+// Fixed cost of a file (open, stat, rename) in terms of bytes moved.
+static const std::uint64_t g_fileCost{32 * 1024};
+// Buffers a worker holds: read buffer and output extent of buffered
+// I/O, aligned buffers of direct I/O, chunks of chunked format and
+// cut buffer of deduplication.
+static const size_t g_ioBuffer{6808 * 154};
+static const size_t g_extentSize{1024 * 1024};
+static const size_t g_directBuffers{4 * 1024 * 1024};
+static const size_t g_defaultChunkSize{1024 * 1024};
+static const size_t g_dedupBuffers{16 * 256 * 1024 + 256 * 1024};
+
+// Set number of workers per rotational and per non-rotational device.
+void Krenq::set_device_concurrency(size_t rotational, size_t nonRotational)
+{
+  if (rotational == 0 or nonRotational == 0)
+    throw std::runtime_error{"Every device needs at least one worker!"};
+  m_hddWorkers = rotational;
+  m_ssdWorkers = nonRotational;
+}
+
+// Run no more workers than fit their buffers in given bytes.
+void Krenq::set_memory_limit(std::uint64_t bytes)
+{
+  m_memoryLimit = bytes;
+}
+
+// Return progress of the running operation.
+Krenq::Progress Krenq::get_progress() const
+{
+  return {m_doneFiles.load(), m_totalFiles.load(), m_doneBytes.load(), m_totalBytes.load()};
+}
+
+// Return roughly how many bytes of buffers a worker holds at most
+// with current settings.
+size_t Krenq::worker_memory()
+{
+  size_t bytes{m_directIo ? g_directBuffers : g_ioBuffer + g_extentSize};
+  if (m_chunkSize > 0 or m_compression)
+    bytes = std::max(bytes, 2 * (m_chunkSize > 0 ? m_chunkSize : g_defaultChunkSize) + g_extentSize);
+  if (!m_dedupStore.empty()) bytes = std::max(bytes, g_dedupBuffers + g_extentSize);
+  return bytes;
+}
+
+// Return number of workers fitting memory limit, all devices together.
+size_t Krenq::memory_workers()
+{
+  if (m_memoryLimit == 0) return SIZE_MAX;
+  return std::max<size_t>(1, m_memoryLimit / this->worker_memory());
+}
+
+//
+// Find out if device is a spinning disk. The device of a partition
+// has no queue of its own, so the queue of its parent disk is asked.
+// Devices unknown to sysfs (tmpfs, network filesystems) are treated
+// as non-rotational.
+//
+bool Krenq::is_rotational(std::uint64_t dev)
+{
+  std::string sysdev{"/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev))};
+  for (auto queue : {sysdev + "/queue/rotational", sysdev + "/../queue/rotational"})
+  {
+    std::fstream ifile{queue, std::ios::in};
+    char flag{};
+    if (ifile.get(flag)) return flag == '1';
+  }
+  return false;
+}
+
+//
+// Bucket regular files found under entries by device.
+//
+// Paths naming the same inode (repeated entries, hard links) are
+// kept next to each other in one job, so that no two workers ever
+// touch the same file and the file is worked on once.
+// Jobs of spinning disks are ordered by inode, which roughly follows
+// on-disk placement and keeps the head from seeking back and forth.
+// Jobs of other devices are balanced for parallel workers instead.
+//
+std::vector<Krenq::DeviceQueue> Krenq::plan_jobs(const std::vector<std::string>& entries)
+{
+  std::map<std::uint64_t, std::map<std::uint64_t, std::vector<Krenq::FileJob>>> devices{};
+  for (auto& file : this->walk_entries(entries))
+    devices[file.s_dev][file.s_ino].emplace_back(std::move(file));
+
+  std::vector<Krenq::DeviceQueue> queues{};
+  for (auto& [dev, inodes] : devices)
+  {
+    Krenq::DeviceQueue queue{};
+    queue.s_dev = dev;
+    queue.s_rotational = this->is_rotational(dev);
+    queue.s_workers = queue.s_rotational ? m_hddWorkers : m_ssdWorkers;
+    // std::map iterates inodes in ascending order.
+    for (auto& [ino, files] : inodes)
+      queue.s_jobs.emplace_back(std::move(files));
+    if (!queue.s_rotational) this->balance_jobs(queue);
+    queues.emplace_back(std::move(queue));
+  }
+  return queues;
+}
+
+//
+// Order jobs of a device largest first (LPT scheduling).
+//
+// Workers pull jobs in queue order, so with the heaviest jobs first
+// the last job to start is a short one and all workers finish close
+// to each other, instead of a single huge file found last keeping
+// one worker busy long after the others went idle. Small files are
+// packed into batches first so that a worker takes many of them at
+// once rather than contending on the queue for each one.
+//
+void Krenq::balance_jobs(Krenq::DeviceQueue& queue)
+{
+  auto weight{[](const std::vector<Krenq::FileJob>& job)
+  {
+    std::uint64_t w{};
+    for (auto& file : job) w += file.s_size + g_fileCost;
+    return w;
+  }};
+  std::vector<std::pair<std::uint64_t, std::vector<Krenq::FileJob>>> jobs{};
+  std::vector<Krenq::FileJob> batch{};
+  std::uint64_t batchWeight{};
+  for (auto& job : queue.s_jobs)
+  {
+    std::uint64_t w{weight(job)};
+    if (job.front().s_size > g_smallFile)
+    {
+      jobs.emplace_back(w, std::move(job));
+      continue;
+    }
+    batch.insert(batch.end(), std::make_move_iterator(job.begin()), std::make_move_iterator(job.end()));
+    batchWeight += w;
+    if (batchWeight >= g_batchWeight)
+    {
+      jobs.emplace_back(batchWeight, std::move(batch));
+      batch = {};
+      batchWeight = 0;
+    }
+  }
+  if (!batch.empty()) jobs.emplace_back(batchWeight, std::move(batch));
+  std::stable_sort(jobs.begin(), jobs.end(), [](const auto& a, const auto& b){ return a.first > b.first; });
+  queue.s_jobs.clear();
+  for (auto& job : jobs) queue.s_jobs.emplace_back(std::move(job.second));
+}
+
+//
+// Run jobs of every device at the same time, each device with its
+// own workers. Workers pull the next job of their device until the
+// device runs out of work. The first exception thrown by any worker
+// stops all workers and is rethrown to the caller. Batched commits
+// still pending when workers are done are flushed before returning.
+// Every worker holds an arena of the pool while it runs, so buffers
+// and state of one run are there for the next.
+//
+// With a memory limit, devices give up workers in proportion to how
+// many they have, each device keeping at least one.
+//
+void Krenq::run_jobs(std::vector<Krenq::DeviceQueue>& queues, const std::function<void(const Krenq::FileJob&)>& work)
+{
+  std::vector<std::atomic<size_t>> next(queues.size());
+  std::atomic<bool> failed{false};
+  std::exception_ptr error{};
+  std::mutex emutex{};
+  std::vector<std::thread> workers{};
+  std::vector<size_t> nworkers(queues.size());
+  size_t allWorkers{};
+  m_doneFiles = 0;
+  m_doneBytes = 0;
+  size_t totalFiles{};
+  std::uint64_t totalBytes{};
+  for (size_t q{}; q < queues.size(); ++q)
+  {
+    nworkers[q] = std::min(queues[q].s_workers, queues[q].s_jobs.size());
+    allWorkers += nworkers[q];
+    for (auto& job : queues[q].s_jobs)
+      for (auto& file : job)
+      {
+        ++totalFiles;
+        totalBytes += file.s_size;
+      }
+  }
+  m_totalFiles = totalFiles;
+  m_totalBytes = totalBytes;
+  size_t allowed{this->memory_workers()};
+  if (allWorkers > allowed)
+    for (auto& n : nworkers) n = std::max<size_t>(1, n * allowed / allWorkers);
+  for (size_t q{}; q < queues.size(); ++q)
+  {
+    for (size_t w{}; w < nworkers[q]; ++w)
+      workers.emplace_back([&, q]
+      {
+        Krenq::Arena* arena{nullptr};
+        try
+        {
+          arena = this->acquire_arena();
+          this->apply_io_priority();
+          for (size_t j{next[q]++}; j < queues[q].s_jobs.size() and !failed; j = next[q]++)
+          {
+            auto& job{queues[q].s_jobs[j]};
+            for (size_t f{}; f < job.size(); ++f)
+            {
+              // Other paths of a file just worked on would see the old
+              // file as long as its commit is pending, so they are left.
+              if (f == 0 or job[f].s_dev != job[f - 1].s_dev or job[f].s_ino != job[f - 1].s_ino) work(job[f]);
+              ++m_doneFiles;
+              m_doneBytes += job[f].s_size;
+            }
+          }
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock{emutex};
+          if (!failed.exchange(true)) error = std::current_exception();
+        }
+        if (arena) this->release_arena(arena);
+      });
+  }
+  for (auto& worker : workers) worker.join();
+  // Files completed before a failure are committed all the same.
+  try
+  {
+    this->flush_commits();
+  }
+  catch (...)
+  {
+    if (!error) error = std::current_exception();
+  }
+  if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,107 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+//
+// Sparse files.
+//
+// Only data extents of a sparse file are read and encrypted, back to
+// back, as if they were the whole file. Where they go is kept in an
+// extent map, and decrypting writes them back there, leaving holes in
+// between.
+//
+
+//
+// Find data extents of a file, holes left out. Files on filesystems
+// which can't tell holes apart come out as a single extent.
+//
+void Krenq::find_extents(int fd, std::uint64_t filesize, std::vector<Krenq::Extent>& extents)
+{
+  extents.clear();
+  std::uint64_t packed{0};
+  for (off_t offset{0}; static_cast<std::uint64_t>(offset) < filesize;)
+  {
+    off_t data{lseek(fd, offset, SEEK_DATA)};
+    if (data < 0 and errno == ENXIO) break;
+    if (data < 0)
+    {
+      extents = {Krenq::Extent{0, filesize, 0}};
+      return;
+    }
+    off_t hole{lseek(fd, data, SEEK_HOLE)};
+    if (hole < 0 or static_cast<std::uint64_t>(hole) > filesize) hole = static_cast<off_t>(filesize);
+    if (hole <= data) break;
+    std::uint64_t length{static_cast<std::uint64_t>(hole - data)};
+    extents.emplace_back(Krenq::Extent{static_cast<std::uint64_t>(data), length, packed});
+    packed += length;
+    offset = hole;
+  }
+}
+
+//
+// Whether a file really has holes. Fewer blocks than its size is only
+// a hint: inline data, compressing filesystems and delayed allocation
+// give dense files fewer blocks too, and those must keep the format
+// older versions can read. A file that can't be opened is taken as
+// dense and fails later, where it's read.
+//
+bool Krenq::has_holes(const std::string& filename, std::uint64_t filesize)
+{
+  int fd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) return false;
+  std::vector<Krenq::Extent>& extents{this->arena().s_extents};
+  this->find_extents(fd, filesize, extents);
+  close(fd);
+  return !(extents.size() == 1 and extents.front().s_offset == 0 and extents.front().s_length == filesize);
+}
+
+// Index of extent holding given packed offset.
+size_t Krenq::find_packed(const std::vector<Krenq::Extent>& extents, std::uint64_t packed)
+{
+  auto iter{std::upper_bound(extents.begin(), extents.end(), packed,
+    [](std::uint64_t p, const Krenq::Extent& e){ return p < e.s_packed; })};
+  return iter == extents.begin() ? 0 : static_cast<size_t>(iter - extents.begin()) - 1;
+}
+
+//
+// Read n bytes of data extents at packed offset. Less than n is
+// returned if the file got shorter.
+//
+size_t Krenq::read_extents(int fd, const std::vector<Krenq::Extent>& extents, unsigned char* buf, size_t n, std::uint64_t packed)
+{
+  size_t done{0};
+  for (auto iter{extents.begin() + this->find_packed(extents, packed)}; done < n and iter != extents.end(); ++iter)
+  {
+    std::uint64_t skip{packed + done - iter->s_packed};
+    size_t len{static_cast<size_t>(std::min<std::uint64_t>(n - done, iter->s_length - skip))};
+    size_t got{this->input_read(fd, buf + done, len, iter->s_offset + skip)};
+    done += got;
+    if (got != len) break;
+  }
+  return done;
+}
+
+// Write n bytes of data extents at packed offset to where they belong.
+void Krenq::write_extents(Krenq::OutputFile& out, const std::vector<Krenq::Extent>& extents, const unsigned char* buf, size_t n, std::uint64_t packed)
+{
+  size_t done{0};
+  for (auto iter{extents.begin() + this->find_packed(extents, packed)}; done < n and iter != extents.end(); ++iter)
+  {
+    std::uint64_t skip{packed + done - iter->s_packed};
+    size_t len{static_cast<size_t>(std::min<std::uint64_t>(n - done, iter->s_length - skip))};
+    this->output_seek(out, iter->s_offset + skip);
+    this->output_write(out, buf + done, len);
+    done += len;
+  }
+}
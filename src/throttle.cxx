@@ -0,0 +1,101 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+// ioprio_set(2) has no glibc wrapper, so its constants live here.
+static constexpr int g_ioprioWhoProcess{1};
+static constexpr int g_ioprioClassShift{13};
+
+// Set bandwidth and IOPS limits for all Krenq workers.
+void Krenq::set_io_limits(std::uint64_t readBps, std::uint64_t writeBps, std::uint64_t iops)
+{
+  m_readBucket.s_rate = readBps;
+  m_writeBucket.s_rate = writeBps;
+  m_iopsBucket.s_rate = iops;
+}
+
+// Set I/O scheduling class, level and nice value for Krenq workers.
+void Krenq::set_io_priority(Krenq::IoClass ioclass, int iolevel, int niceness)
+{
+  if (iolevel < 0 or iolevel > 7)
+    throw std::runtime_error{"I/O level must be within 0 and 7!"};
+  if (niceness < -20 or niceness > 19)
+    throw std::runtime_error{"Nice value must be within -20 and 19!"};
+  m_ioclass = ioclass;
+  m_iolevel = iolevel;
+  m_niceness = niceness;
+}
+
+//
+// Take amount of tokens from bucket, sleeping if bucket runs dry.
+//
+// Tokens are refilled at the bucket rate and at most one second
+// worth of burst is kept. The bucket is allowed to go into debt so
+// a request larger than the burst still passes, and the thread that
+// caused the debt pays it off by sleeping. Concurrent workers see
+// the debt left by others, so the aggregate rate holds.
+//
+void Krenq::throttle(Krenq::TokenBucket& bucket, std::uint64_t amount)
+{
+  std::uint64_t rate{bucket.s_rate};
+  if (rate == 0) return;
+  double debt{};
+  {
+    std::lock_guard<std::mutex> lock{bucket.s_mutex};
+    auto now{std::chrono::steady_clock::now()};
+    if (bucket.s_last == std::chrono::steady_clock::time_point{})
+      bucket.s_tokens = static_cast<double>(rate);
+    else
+    {
+      double elapsed{std::chrono::duration<double>(now - bucket.s_last).count()};
+      bucket.s_tokens = std::min(bucket.s_tokens + elapsed * rate, static_cast<double>(rate));
+    }
+    bucket.s_last = now;
+    bucket.s_tokens -= static_cast<double>(amount);
+    if (bucket.s_tokens < 0) debt = -bucket.s_tokens;
+  }
+  if (debt > 0)
+    std::this_thread::sleep_for(std::chrono::duration<double>(debt / rate));
+}
+
+// Account one read operation of given bytes.
+void Krenq::throttle_read(std::uint64_t bytes)
+{
+  this->throttle(m_iopsBucket, 1);
+  this->throttle(m_readBucket, bytes);
+}
+
+// Account one write operation of given bytes.
+void Krenq::throttle_write(std::uint64_t bytes)
+{
+  this->throttle(m_iopsBucket, 1);
+  this->throttle(m_writeBucket, bytes);
+}
+
+// Apply configured I/O class and nice value to the calling thread.
+void Krenq::apply_io_priority()
+{
+  if (m_ioclass != Krenq::IoClass::none)
+  {
+    int ioprio{static_cast<int>(m_ioclass) << g_ioprioClassShift | m_iolevel};
+    if (syscall(SYS_ioprio_set, g_ioprioWhoProcess, 0, ioprio) != 0)
+      throw std::runtime_error{"Failed to set I/O priority of Krenq worker!"};
+  }
+  if (m_niceness != 0)
+  {
+    // On Linux, nice value is a per-thread attribute.
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), m_niceness) != 0)
+      throw std::runtime_error{"Failed to set nice value of Krenq worker!"};
+  }
+}
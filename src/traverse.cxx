@@ -0,0 +1,158 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <condition_variable>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Size of buffer handed to getdents64 at once.
+static const size_t g_direntBufSize{64 * 1024};
+// Attributes asked from statx, everything a file job needs.
+static const unsigned g_statxMask{STATX_TYPE | STATX_INO | STATX_SIZE | STATX_BLOCKS};
+
+//
+// Walk entries and return all regular files found under them.
+//
+// Every file costs a single statx, made relative to the descriptor
+// of its directory so that the path isn't resolved again. Types
+// reported by getdents64 are trusted, so subdirectories are never
+// stat'ed at all. As before, symlinks to files are followed while
+// symlinks to directories are not.
+//
+// Directories are scanned by as many workers as a non-rotational
+// device gets, so huge trees are walked in parallel, one subtree per
+// worker at a time.
+//
+// Chunk store is never walked into, wherever it is under entries, so
+// its chunks are neither encrypted nor decrypted as files of their own.
+//
+std::vector<Krenq::FileJob> Krenq::walk_entries(const std::vector<std::string>& entries)
+{
+  std::vector<Krenq::FileJob> files{};
+  std::vector<std::string> dirs{};
+  // Device and inode of chunk store, none if zero.
+  std::pair<std::uint64_t, std::uint64_t> store{};
+  struct statx sstx{};
+  if (!m_dedupStore.empty() and statx(AT_FDCWD, m_dedupStore.c_str(), AT_STATX_SYNC_AS_STAT, g_statxMask, &sstx) == 0)
+    store = {makedev(sstx.stx_dev_major, sstx.stx_dev_minor), sstx.stx_ino};
+  for (auto& e : entries)
+  {
+    struct statx stx{};
+    if (statx(AT_FDCWD, e.c_str(), AT_STATX_SYNC_AS_STAT, g_statxMask, &stx) != 0) continue;
+    if (S_ISREG(stx.stx_mode))
+      files.emplace_back(Krenq::FileJob{e, makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino, stx.stx_size, stx.stx_blocks * 512 < stx.stx_size});
+    else if (S_ISDIR(stx.stx_mode) and (makedev(stx.stx_dev_major, stx.stx_dev_minor) != store.first or stx.stx_ino != store.second))
+      dirs.emplace_back(e);
+  }
+  if (dirs.empty()) return files;
+
+  std::mutex mutex{};
+  std::condition_variable cv{};
+  size_t busy{0};
+  std::string failed{};
+  auto worker{[&]
+  {
+    std::vector<Krenq::FileJob> found{};
+    std::vector<std::string> subdirs{};
+    std::unique_lock<std::mutex> lock{mutex};
+    while (true)
+    {
+      cv.wait(lock, [&]{ return !dirs.empty() or busy == 0; });
+      // Nothing queued and nobody scanning, so nothing will be.
+      if (dirs.empty()) break;
+      std::string dir{std::move(dirs.back())};
+      dirs.pop_back();
+      ++busy;
+      lock.unlock();
+      bool ok{this->walk_directory(dir, store, found, subdirs)};
+      lock.lock();
+      if (!ok and failed.empty()) failed = dir;
+      for (auto& subdir : subdirs) dirs.emplace_back(std::move(subdir));
+      subdirs.clear();
+      --busy;
+      cv.notify_all();
+    }
+    files.insert(files.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+  }};
+  std::vector<std::thread> workers{};
+  for (size_t w{1}; w < m_ssdWorkers; ++w) workers.emplace_back(worker);
+  worker();
+  for (auto& w : workers) w.join();
+  if (!failed.empty())
+    throw std::runtime_error{"Cannot read directory " + failed + "!"};
+  return files;
+}
+
+//
+// Scan a single directory. Files go to files, subdirectories to subdirs
+// but for chunk store, given by device and inode. Only a subdirectory
+// of the inode of the store is stat'ed to tell if it is the store.
+//
+bool Krenq::walk_directory(const std::string& dir, const std::pair<std::uint64_t, std::uint64_t>& store, std::vector<Krenq::FileJob>& files, std::vector<std::string>& subdirs)
+{
+  auto isStore{[&](int dfd, const char* name)
+  {
+    struct statx stx{};
+    return statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT, g_statxMask, &stx) == 0 and
+      makedev(stx.stx_dev_major, stx.stx_dev_minor) == store.first and stx.stx_ino == store.second;
+  }};
+  int dfd{openat(AT_FDCWD, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+  if (dfd < 0) return false;
+  std::string prefix{dir.back() == '/' ? dir : dir + '/'};
+  std::vector<char> buf(g_direntBufSize);
+  while (true)
+  {
+    ssize_t n{getdents64(dfd, buf.data(), buf.size())};
+    if (n < 0)
+    {
+      close(dfd);
+      return false;
+    }
+    if (n == 0) break;
+    for (ssize_t pos{}; pos < n;)
+    {
+      auto* d{reinterpret_cast<struct dirent64*>(buf.data() + pos)};
+      pos += d->d_reclen;
+      if (std::strcmp(d->d_name, ".") == 0 or std::strcmp(d->d_name, "..") == 0) continue;
+      unsigned char type{d->d_type};
+      if (type == DT_DIR)
+      {
+        if (d->d_ino != store.second or !isStore(dfd, d->d_name)) subdirs.emplace_back(prefix + d->d_name);
+        continue;
+      }
+      if (type != DT_REG and type != DT_LNK and type != DT_UNKNOWN) continue;
+      // Only symlinks are followed, so a directory behind one is seen
+      // as a directory and skipped.
+      int flags{type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW};
+      struct statx stx{};
+      if (statx(dfd, d->d_name, flags | AT_STATX_SYNC_AS_STAT, g_statxMask, &stx) != 0) continue;
+      if (type == DT_UNKNOWN and S_ISLNK(stx.stx_mode))
+      {
+        if (statx(dfd, d->d_name, AT_STATX_SYNC_AS_STAT, g_statxMask, &stx) != 0) continue;
+        if (S_ISDIR(stx.stx_mode)) continue;
+      }
+      else if (type == DT_UNKNOWN and S_ISDIR(stx.stx_mode))
+      {
+        if (makedev(stx.stx_dev_major, stx.stx_dev_minor) != store.first or stx.stx_ino != store.second) subdirs.emplace_back(prefix + d->d_name);
+        continue;
+      }
+      if (S_ISREG(stx.stx_mode))
+        files.emplace_back(Krenq::FileJob{prefix + d->d_name, makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino, stx.stx_size, stx.stx_blocks * 512 < stx.stx_size});
+    }
+  }
+  close(dfd);
+  return true;
+}
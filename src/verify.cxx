@@ -0,0 +1,358 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <array>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Holds the length of actual key.
+static const size_t g_actualKlen{154};
+// Smallest possible encrypted file: header, manifest header, a single
+// manifest entry and trailer.
+static const size_t g_minEncryptedSize{32 + 12 + 1 + 12 + 24 + 36 + 32};
+// Size of header: plain file hash, pattern, marker, pattern.
+static const size_t g_headerSize{32 + 12 + 1 + 12};
+// Size of trailer: encrypted key hash.
+static const size_t g_keyHashSize{32};
+// Number of key-sized blocks read at once, about a MiB.
+static const size_t g_ioBlocks{6808};
+// Size of chunk header of a chunked file.
+static const size_t g_chunkHeaderSize{36};
+// Size of a hash in Merkle tree.
+static const size_t g_nodeSize{32};
+// Chunks of a chunked file verified by a worker in one go. Files of
+// more chunks are split between workers.
+static const size_t g_chunksPerTask{64};
+// Bytes of leaves and chunk offsets of large files held at once while
+// their chunks are verified, those of over a million chunks. Files are
+// never split between batches, so a single file larger than this, of
+// over some 1.6 million chunks, is held whole in a batch of its own.
+static const std::uint64_t g_treeBudget{64 * 1024 * 1024};
+// Largest chunk of a deduplicated file.
+static const size_t g_maxCut{256 * 1024};
+
+//
+// Verify all entries encrypted with given key against the hash of
+// their plain data, without writing anything. Files encrypted with
+// other keys and plain files are counted as skipped.
+//
+Krenq::VerifyReport Krenq::verify_all(const std::string& keyname)
+{
+  std::shared_ptr<const Krenq::KeyTile> key{this->extract_key(keyname)};
+  return this->verify_entries(m_entries, Krenq::KeyRing{{key->s_keyHash, key}});
+}
+
+//
+// Verify given entries in parallel and sum up the outcome.
+//
+// Files are verified one per worker at first. Chunked files too
+// large for a single worker are left for a second round, in which
+// their chunks are split between all workers, a batch of files at a
+// time to keep memory bounded.
+//
+Krenq::VerifyReport Krenq::verify_entries(const std::vector<std::string>& entries, const Krenq::KeyRing& ring)
+{
+  Krenq::VerifyReport report{};
+  std::mutex mutex{};
+  std::vector<Krenq::FileJob> large{};
+  auto tally{[&report](const std::string& filename, Krenq::Verdict verdict)
+  {
+    if (verdict == Krenq::Verdict::intact) ++report.s_intact;
+    else if (verdict == Krenq::Verdict::skipped) ++report.s_skipped;
+    else
+    {
+      ++report.s_corrupted;
+      report.s_corruptedFiles.emplace_back(filename);
+    }
+  }};
+  std::vector<Krenq::DeviceQueue> queues{this->plan_jobs(entries)};
+  this->run_jobs(queues, [&](const Krenq::FileJob& file)
+  {
+    std::uint64_t bytes{};
+    Krenq::Verdict verdict{this->verify_file(file, ring, bytes)};
+    std::lock_guard<std::mutex> lock{mutex};
+    report.s_bytes += bytes;
+    if (verdict == Krenq::Verdict::deferred) large.emplace_back(file);
+    else tally(file.s_path, verdict);
+  });
+  if (large.empty()) return report;
+
+  // Check trees of large files and split their chunks into tasks, a
+  // batch of files at a time so that their trees and offsets are
+  // never held all at once.
+  struct Task
+  {
+    size_t s_file{};
+    size_t s_first{};
+    size_t s_last{};
+  };
+  std::vector<std::shared_ptr<const Krenq::KeyTile>> keys{};
+  std::vector<Krenq::ChunkHeader> chunkHeaders{};
+  std::vector<std::string> trees{};
+  std::vector<std::vector<std::uint64_t>> offsets{};
+  std::vector<Krenq::Verdict> verdicts{};
+  std::vector<Task> tasks{};
+  std::atomic<size_t> next{0};
+  // Files of batch are large[first] onwards.
+  size_t first{0};
+  std::exception_ptr error{};
+  auto worker{[&]
+  {
+    Krenq::Arena* arena{nullptr};
+    try
+    {
+      arena = this->acquire_arena();
+      this->apply_io_priority();
+      for (size_t t{next++}; t < tasks.size(); t = next++)
+      {
+        const Task& task{tasks[t]};
+        bool intact{false};
+        int fd{open(large[first + task.s_file].s_path.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (fd >= 0)
+        {
+          try
+          {
+            intact = this->verify_chunks(fd, chunkHeaders[task.s_file], offsets[task.s_file], trees[task.s_file], *keys[task.s_file], task.s_first, task.s_last);
+          }
+          catch (const std::exception&)
+          {
+          }
+          close(fd);
+        }
+        if (intact) continue;
+        std::lock_guard<std::mutex> lock{mutex};
+        verdicts[task.s_file] = Krenq::Verdict::corrupted;
+      }
+    }
+    catch (...)
+    {
+      // Remaining tasks are left to other workers, the error is
+      // rethrown once all of them are done.
+      std::lock_guard<std::mutex> lock{mutex};
+      if (!error) error = std::current_exception();
+    }
+    if (arena) this->release_arena(arena);
+  }};
+  std::uint64_t held{0};
+  for (size_t f{}; f < large.size(); ++f)
+  {
+    size_t b{trees.size()};
+    Krenq::EStatus estatus{this->krenq_status(large[f].s_path)};
+    auto found{ring.find(estatus.key_hash())};
+    keys.emplace_back(found == ring.end() ? nullptr : found->second);
+    chunkHeaders.emplace_back();
+    trees.emplace_back();
+    offsets.emplace_back();
+    // A file changed since its first round may be of another key now.
+    if (found == ring.end()) verdicts.emplace_back(Krenq::Verdict::skipped);
+    else
+    {
+      verdicts.emplace_back(this->verify_tree(large[f].s_path, estatus.s_size, chunkHeaders[b], trees[b], offsets[b]));
+      report.s_bytes += estatus.s_size;
+    }
+    if (verdicts[b] == Krenq::Verdict::intact)
+    {
+      size_t chunks{static_cast<size_t>((chunkHeaders[b].s_plainSize - 1) / chunkHeaders[b].s_chunkSize + 1)};
+      for (size_t c{}; c < chunks; c += g_chunksPerTask)
+        tasks.emplace_back(Task{b, c, std::min(chunks, c + g_chunksPerTask)});
+      held += trees[b].size() + offsets[b].size() * sizeof(std::uint64_t);
+    }
+    if (held < g_treeBudget and f + 1 < large.size()) continue;
+
+    next = 0;
+    std::vector<std::thread> workers{};
+    for (size_t w{1}; w < std::min({m_ssdWorkers, this->memory_workers(), tasks.size()}); ++w) workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers) w.join();
+    if (error) std::rethrow_exception(error);
+    for (size_t v{}; v < verdicts.size(); ++v) tally(large[first + v].s_path, verdicts[v]);
+    keys.clear();
+    chunkHeaders.clear();
+    trees.clear();
+    offsets.clear();
+    verdicts.clear();
+    tasks.clear();
+    first = f + 1;
+    held = 0;
+  }
+  return report;
+}
+
+//
+// Read tree of a chunked file and check that it is whole: its root,
+// sealed with extent map if any, must be the one in header and its
+// inner nodes must follow from its leaves. Leaves are returned in
+// leaves, where chunks start in body in offsets.
+//
+Krenq::Verdict Krenq::verify_tree(const std::string& filename, std::uint64_t filesize, Krenq::ChunkHeader& chunkHeader, std::string& leaves, std::vector<std::uint64_t>& offsets)
+{
+  int fd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (fd < 0) return Krenq::Verdict::corrupted;
+  bool whole{false};
+  try
+  {
+    if (this->read_chunk_header(fd, filesize, chunkHeader) and this->read_chunk_offsets(fd, chunkHeader, offsets))
+    {
+      size_t chunks{static_cast<size_t>((chunkHeader.s_plainSize - 1) / chunkHeader.s_chunkSize + 1)};
+      std::string stored(this->merkle_nodes(chunks) * g_nodeSize, '\0');
+      std::string root(g_nodeSize, '\0');
+      std::vector<Krenq::Extent> extents{};
+      std::uint64_t plainFilesize{};
+      std::string map{};
+      if (pread(fd, root.data(), g_nodeSize, 0) == static_cast<ssize_t>(g_nodeSize) and
+        this->input_read(fd, reinterpret_cast<unsigned char*>(stored.data()), stored.size(), g_headerSize + g_chunkHeaderSize) == stored.size() and
+        this->read_extent_map(fd, chunkHeader, extents, plainFilesize, map))
+      {
+        leaves = stored.substr(0, chunks * g_nodeSize);
+        std::string tree{leaves};
+        tree.resize(stored.size());
+        this->merkle_tree(tree.data(), chunks);
+        std::string sealed(g_nodeSize, '\0');
+        this->seal_root(stored.data() + stored.size() - g_nodeSize, map, sealed.data());
+        whole = tree == stored and sealed == root;
+      }
+    }
+  }
+  catch (const std::runtime_error&)
+  {
+  }
+  close(fd);
+  return whole ? Krenq::Verdict::intact : Krenq::Verdict::corrupted;
+}
+
+//
+// Decrypt a single file into a scratch buffer, a buffer at a time,
+// and compare the hash of its plain data with the one in header.
+//
+// Files written by older versions hash plain data only up to its
+// first null byte, so both hashes are taken on the way and either
+// one matching is fine. A file that can't be read to its end counts
+// as corrupted. Read bytes are added to bytes.
+//
+// Chunked files are checked against their tree instead. Those too
+// large for a single worker are deferred. Deduplicated files have
+// every chunk checked as it is read from chunk store.
+//
+Krenq::Verdict Krenq::verify_file(const Krenq::FileJob& file, const Krenq::KeyRing& ring, std::uint64_t& bytes)
+{
+  if (file.s_size < g_minEncryptedSize) return Krenq::Verdict::skipped;
+  const std::string& filename{file.s_path};
+  Krenq::EStatus estatus{this->krenq_status(filename)};
+  if (!estatus.s_encrypted) return Krenq::Verdict::skipped;
+  auto found{ring.find(estatus.key_hash())};
+  if (found == ring.end()) return Krenq::Verdict::skipped;
+  const Krenq::KeyTile& key{*found->second};
+  std::uint64_t filesize{estatus.s_size};
+  if (this->is_manifest(estatus))
+  {
+    std::string& stored{this->arena().s_hash};
+    std::vector<Krenq::ManifestEntry>& entries{this->arena().s_entries};
+    if (!this->read_manifest(filename, filesize, key, stored, entries)) return Krenq::Verdict::corrupted;
+    bool intact{false};
+    try
+    {
+      struct Sha_256 full;
+      std::array<std::uint8_t, 32> fullHash{};
+      sha_256_init(&full, fullHash.data());
+      unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, 2 * g_maxCut)};
+      for (auto& entry : entries)
+      {
+        this->load_chunk(entry, key, fbuf);
+        sha_256_write(&full, fbuf, entry.s_length);
+        bytes += entry.s_length;
+      }
+      sha_256_close(&full);
+      intact = std::memcmp(stored.data(), fullHash.data(), fullHash.size()) == 0;
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    bytes += filesize;
+    return intact ? Krenq::Verdict::intact : Krenq::Verdict::corrupted;
+  }
+  if (this->is_chunked(estatus))
+  {
+    Krenq::ChunkHeader chunkHeader{};
+    std::string leaves{};
+    std::vector<std::uint64_t> offsets{};
+    Krenq::Verdict verdict{this->verify_tree(filename, filesize, chunkHeader, leaves, offsets)};
+    if (verdict != Krenq::Verdict::intact) return verdict;
+    size_t chunks{leaves.size() / g_nodeSize};
+    if (chunks > g_chunksPerTask) return Krenq::Verdict::deferred;
+    int fd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (fd < 0) return Krenq::Verdict::corrupted;
+    bool intact{false};
+    try
+    {
+      intact = this->verify_chunks(fd, chunkHeader, offsets, leaves, key, 0, chunks);
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+    close(fd);
+    bytes += filesize;
+    return intact ? Krenq::Verdict::intact : Krenq::Verdict::corrupted;
+  }
+  std::uint64_t bodysize{filesize - g_headerSize - g_keyHashSize};
+  if (bodysize % g_actualKlen != 0) return Krenq::Verdict::corrupted;
+  int ifd{open(filename.c_str(), O_RDONLY | O_CLOEXEC)};
+  if (ifd < 0) return Krenq::Verdict::corrupted;
+  posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  bool intact{false};
+  try
+  {
+    std::array<unsigned char, 32> stored{};
+    std::array<unsigned char, g_actualKlen> last{};
+    if (pread(ifd, stored.data(), stored.size(), 0) != static_cast<ssize_t>(stored.size()) or
+      pread(ifd, last.data(), g_actualKlen, g_headerSize + bodysize - g_actualKlen) != static_cast<ssize_t>(g_actualKlen))
+      throw std::runtime_error{"Failed to read " + filename};
+    this->apply_key(last.data(), g_actualKlen, 0, key);
+    std::uint64_t plainsize{bodysize - this->remove_padding(last.data())};
+    struct Sha_256 full;
+    struct Sha_256 legacy;
+    std::array<std::uint8_t, 32> fullHash{};
+    std::array<std::uint8_t, 32> legacyHash{};
+    sha_256_init(&full, fullHash.data());
+    sha_256_init(&legacy, legacyHash.data());
+    bool hashing{true};
+    unsigned char* fbuf{this->arena_buffer(Krenq::ArenaSlot::input, g_ioBlocks * g_actualKlen)};
+    for (std::uint64_t offset{}; offset < plainsize;)
+    {
+      size_t n{static_cast<size_t>(std::min<std::uint64_t>(g_ioBlocks * g_actualKlen, bodysize - offset))};
+      if (this->input_read(ifd, fbuf, n, g_headerSize + offset) != n)
+        throw std::runtime_error{"File shrank while being verified: " + filename};
+      this->apply_key(fbuf, n, offset, key);
+      size_t plain{static_cast<size_t>(std::min<std::uint64_t>(n, plainsize - offset))};
+      sha_256_write(&full, fbuf, plain);
+      if (hashing)
+      {
+        auto* nul{static_cast<unsigned char*>(std::memchr(fbuf, 0, plain))};
+        sha_256_write(&legacy, fbuf, nul ? nul - fbuf : plain);
+        hashing = nul == nullptr;
+      }
+      offset += n;
+    }
+    sha_256_close(&full);
+    sha_256_close(&legacy);
+    intact = stored == fullHash or stored == legacyHash;
+  }
+  catch (const std::runtime_error&)
+  {
+    // Unreadable, reported as corrupted below.
+  }
+  close(ifd);
+  bytes += filesize;
+  return intact ? Krenq::Verdict::intact : Krenq::Verdict::corrupted;
+}
@@ -0,0 +1,327 @@
+/**
+ * Krenq - Universal file encryptor written in C++ 20
+ * Copyright (c) 2024 Hossain Md. Fahim <hossainmdfahim66@gmail.com>
+ * Licensed under the GNU General Public License v3.0 (GPL-3.0)
+ * See the LICENSE file for more information.
+ */
+#include "krenq/Core.hxx"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+//
+// Watch mode.
+//
+// Every directory under entries is watched with inotify. A file is
+// taken once it was closed after writing, or moved in, and then left
+// alone for the debounce time; writing to it again starts the wait
+// over. Taken files go through a bounded queue to a fixed number of
+// workers, which encrypt them as encrypt_all() would. Files Krenq
+// renames into place are found encrypted already and left alone.
+//
+
+// Events of watched directories.
+static const std::uint32_t g_watchMask{IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE | IN_ONLYDIR};
+// Buffer handed to read at once, room for plenty of events.
+static const size_t g_eventBufSize{64 * 1024};
+
+// Run op of watching, counting it failed rather than letting it end
+// the watch, or the process.
+template <typename Op>
+static void guarded(Krenq::WatchReport& report, std::mutex& mutex, Op op)
+{
+  try
+  {
+    op();
+  }
+  catch (const std::exception&)
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    ++report.s_failed;
+  }
+}
+
+// Return true for temporary files written by Krenq itself.
+static bool is_temp_name(const std::string& name)
+{
+  size_t krenq{name.find(".krenq")};
+  return krenq != std::string::npos and name.find("temp", krenq) != std::string::npos;
+}
+
+//
+// Start watching entries and encrypting files as they are written,
+// until stop_watch(). Files already there are left to encrypt_all().
+// At most queueSize files wait for a worker; past that, watching
+// waits for workers.
+//
+void Krenq::start_watch(std::chrono::milliseconds debounce, size_t queueSize)
+{
+  if (!m_keyIsSaved)
+    throw std::runtime_error{"Save the key using save_key() before trying to encrypt anything!"};
+  if (m_watcher)
+    throw std::runtime_error{"Krenq is watching already!"};
+  if (queueSize == 0)
+    throw std::runtime_error{"Watch queue needs room for at least one file!"};
+  auto watcher{std::make_unique<Krenq::Watcher>()};
+  watcher->s_debounce = debounce;
+  watcher->s_capacity = queueSize;
+  timespec now{};
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  watcher->s_started = now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+  watcher->s_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  watcher->s_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (watcher->s_fd < 0 or watcher->s_wakeFd < 0)
+  {
+    if (watcher->s_fd >= 0) close(watcher->s_fd);
+    if (watcher->s_wakeFd >= 0) close(watcher->s_wakeFd);
+    throw std::runtime_error{std::string{"Failed to set up watch: "} + std::strerror(errno)};
+  }
+  m_watcher = std::move(watcher);
+  for (auto& entry : m_entries)
+  {
+    std::error_code ec{};
+    if (fs::is_directory(entry, ec))
+      guarded(m_watcher->s_report, m_watcher->s_mutex, [&]{ this->watch_tree(entry, nullptr); });
+    else
+    {
+      // Single files are watched through their directory, and named
+      // the way events name them.
+      fs::path dir{fs::path{entry}.parent_path()};
+      if (dir.empty()) dir = fs::path{"."};
+      this->watch_directory(dir.string(), false);
+      m_watcher->s_files.insert((dir / fs::path{entry}.filename()).string());
+    }
+  }
+  for (size_t w{}; w < std::min(m_ssdWorkers, this->memory_workers()); ++w)
+    m_watcher->s_workers.emplace_back([this]{ this->watch_worker(); });
+  m_watcher->s_thread = std::thread{[this]{ this->watch_loop(); }};
+}
+
+//
+// Stop watching. Files seen so far are still encrypted, without
+// waiting out their debounce time, before this returns.
+//
+Krenq::WatchReport Krenq::stop_watch()
+{
+  if (!m_watcher) return {};
+  std::uint64_t one{1};
+  if (write(m_watcher->s_wakeFd, &one, sizeof(one)) < 0) {}
+  m_watcher->s_thread.join();
+  {
+    std::lock_guard<std::mutex> lock{m_watcher->s_mutex};
+    m_watcher->s_stopping = true;
+  }
+  m_watcher->s_notEmpty.notify_all();
+  for (auto& worker : m_watcher->s_workers) worker.join();
+  close(m_watcher->s_fd);
+  close(m_watcher->s_wakeFd);
+  Krenq::WatchReport report{m_watcher->s_report};
+  m_watcher.reset();
+  this->flush_commits();
+  return report;
+}
+
+//
+// Watch a single directory. Directories watched whole have all their
+// files taken, others only the files among entries.
+//
+void Krenq::watch_directory(const std::string& dir, bool whole)
+{
+  int wd{inotify_add_watch(m_watcher->s_fd, dir.c_str(), g_watchMask)};
+  if (wd < 0) return;
+  auto& watched{m_watcher->s_dirs[wd]};
+  // A moved directory keeps its watch under the new path.
+  watched.first = dir;
+  watched.second = watched.second or whole;
+}
+
+//
+// Watch a directory and every directory below it, not following
+// symlinks. Files found on the way go to found, if given, as they may
+// have been written before their directory was watched.
+//
+void Krenq::watch_tree(const std::string& root, std::vector<std::string>* found)
+{
+  this->watch_directory(root, true);
+  std::error_code ec{};
+  for (fs::recursive_directory_iterator iter{root, fs::directory_options::skip_permission_denied, ec}, end{}; !ec and iter != end; iter.increment(ec))
+  {
+    if (iter->is_directory(ec) and !iter->is_symlink(ec)) this->watch_directory(iter->path().string(), true);
+    else if (found and iter->is_regular_file(ec)) found->emplace_back(iter->path().string());
+  }
+}
+
+//
+// Read events as they come and hand files that stayed closed for the
+// debounce time to workers. On queue overflow, whatever was missed is
+// found by scanning all entries again; only files changed since
+// watching started are taken, the rest is still left to
+// encrypt_all(). A scan or a new directory that fails is counted
+// failed and watching goes on.
+//
+void Krenq::watch_loop()
+{
+  Krenq::Watcher& watcher{*m_watcher};
+  std::vector<char> buf(g_eventBufSize);
+  bool stopping{false};
+  while (!stopping)
+  {
+    auto now{std::chrono::steady_clock::now()};
+    int timeout{-1};
+    for (auto& [path, due] : watcher.s_pending)
+    {
+      auto wait{std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1};
+      int ms{static_cast<int>(std::clamp<long long>(wait, 0, INT_MAX))};
+      timeout = timeout < 0 ? ms : std::min(timeout, ms);
+    }
+    std::array<pollfd, 2> fds{pollfd{watcher.s_fd, POLLIN, 0}, pollfd{watcher.s_wakeFd, POLLIN, 0}};
+    if (poll(fds.data(), fds.size(), timeout) < 0 and errno != EINTR) break;
+    stopping = fds[1].revents != 0;
+    std::vector<std::string> found{};
+    for (ssize_t len{}; (len = read(watcher.s_fd, buf.data(), buf.size())) > 0;)
+    {
+      for (char* p{buf.data()}; p < buf.data() + len;)
+      {
+        auto* event{reinterpret_cast<inotify_event*>(p)};
+        p += sizeof(inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+          guarded(watcher.s_report, watcher.s_mutex, [&]
+          {
+            for (auto& file : this->walk_entries(m_entries))
+            {
+              struct stat st{};
+              if (stat(file.s_path.c_str(), &st) == 0 and st.st_ctim.tv_sec * 1'000'000'000LL + st.st_ctim.tv_nsec >= watcher.s_started)
+                found.emplace_back(file.s_path);
+            }
+          });
+          continue;
+        }
+        if (event->mask & IN_IGNORED)
+        {
+          watcher.s_dirs.erase(event->wd);
+          continue;
+        }
+        auto dir{watcher.s_dirs.find(event->wd)};
+        if (dir == watcher.s_dirs.end() or event->len == 0) continue;
+        std::string name{event->name};
+        std::string path{(fs::path{dir->second.first} / name).string()};
+        if (event->mask & IN_ISDIR)
+        {
+          if (dir->second.second and (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            guarded(watcher.s_report, watcher.s_mutex, [&]{ this->watch_tree(path, &found); });
+          continue;
+        }
+        if (is_temp_name(name)) continue;
+        if (!dir->second.second and !watcher.s_files.contains(path)) continue;
+        auto pending{watcher.s_pending.find(path)};
+        // Writing to a file already seen puts it off again.
+        if (event->mask & IN_MODIFY)
+        {
+          if (pending != watcher.s_pending.end()) pending->second = std::chrono::steady_clock::now() + watcher.s_debounce;
+          continue;
+        }
+        if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) found.emplace_back(path);
+      }
+    }
+    now = std::chrono::steady_clock::now();
+    for (auto& path : found) watcher.s_pending[path] = now + watcher.s_debounce;
+    std::vector<std::string> due{};
+    for (auto iter{watcher.s_pending.begin()}; iter != watcher.s_pending.end();)
+    {
+      if (!stopping and iter->second > now)
+      {
+        ++iter;
+        continue;
+      }
+      due.emplace_back(iter->first);
+      iter = watcher.s_pending.erase(iter);
+    }
+    for (auto& path : due)
+    {
+      std::unique_lock<std::mutex> lock{watcher.s_mutex};
+      // A file is never worked on by two workers at once, they'd write
+      // the same temporary file.
+      if (!watcher.s_inFlight.insert(path).second)
+      {
+        watcher.s_parked.insert(path);
+        continue;
+      }
+      watcher.s_notFull.wait(lock, [&]{ return watcher.s_queue.size() < watcher.s_capacity; });
+      watcher.s_queue.emplace_back(path);
+      watcher.s_notEmpty.notify_one();
+    }
+  }
+}
+
+//
+// Encrypt files from watch queue until watching stops and the queue
+// is empty. A file that fails is counted and skipped. A file taken
+// again while it was encrypted is queued again once it's done, past
+// the queue limit if need be, as workers can't wait for room. Pending
+// batched commits are flushed whenever the queue runs dry.
+//
+void Krenq::watch_worker()
+{
+  Krenq::Watcher& watcher{*m_watcher};
+  Krenq::Arena* arena{this->acquire_arena()};
+  // Files are still encrypted if priority can't be set.
+  guarded(watcher.s_report, watcher.s_mutex, [this]{ this->apply_io_priority(); });
+  while (true)
+  {
+    std::string path{};
+    {
+      std::unique_lock<std::mutex> lock{watcher.s_mutex};
+      watcher.s_notEmpty.wait(lock, [&]{ return !watcher.s_queue.empty() or watcher.s_stopping; });
+      if (watcher.s_queue.empty()) break;
+      path = std::move(watcher.s_queue.front());
+      watcher.s_queue.pop_front();
+      ++watcher.s_busy;
+    }
+    watcher.s_notFull.notify_one();
+    bool encrypted{false};
+    bool failed{false};
+    try
+    {
+      for (auto& file : this->walk_entries({path})) encrypted = this->encrypt(file) or encrypted;
+    }
+    catch (const std::exception&)
+    {
+      failed = true;
+    }
+    bool idle{false};
+    {
+      std::lock_guard<std::mutex> lock{watcher.s_mutex};
+      if (encrypted) ++watcher.s_report.s_encrypted;
+      if (failed) ++watcher.s_report.s_failed;
+      watcher.s_inFlight.erase(path);
+      if (watcher.s_parked.erase(path) > 0)
+      {
+        watcher.s_inFlight.insert(path);
+        watcher.s_queue.emplace_back(std::move(path));
+        watcher.s_notEmpty.notify_one();
+      }
+      idle = --watcher.s_busy == 0 and watcher.s_queue.empty();
+    }
+    if (!idle) continue;
+    try
+    {
+      this->flush_commits();
+    }
+    catch (const std::exception&)
+    {
+    }
+  }
+  this->release_arena(arena);
+}